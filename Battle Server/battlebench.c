@@ -0,0 +1,83 @@
+// battlebench - runs the battle rules (engine.c) without any sockets
+// and reports how many battles and turns per second they sustain
+//
+// >> make bench
+// >> ./battlebench -n 10000000 -s 42
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <time.h>
+#include "engine.h"
+
+#define BATTLES 5000000 // default number of battles to simulate
+
+// This function returns the current time in seconds
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// This function prints the command line options and exits
+static void usage(char *prog)
+{
+    fprintf(stderr, "usage: %s [-n battles] [-s seed]\n", prog);
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    long battles = BATTLES, turns = 0, wins1 = 0, b;
+    unsigned int seed = 1; // battle b rolls like the server's match b with -S seed
+    struct rng pick; // the players' choice of move, kept apart so the rules see the same rolls
+    struct rng dice[2]; // each side's rolls, as in the server
+    struct fighter f[2];
+    int c, t, dmg;
+    double start, secs;
+    while ((c = getopt(argc, argv, "n:s:")) != -1)
+    {
+	switch (c)
+	{
+	case 'n':
+	    battles = atol(optarg);
+	    break;
+	case 's':
+	    seed = strtoul(optarg, NULL, 10);
+	    break;
+	default:
+	    usage(argv[0]);
+	}
+    }
+    if (battles < 1)
+	usage(argv[0]);
+    engine_seed(&pick, seed ^ 0x9e3779b9, 0);
+    start = now();
+    for (b = 0; b < battles; b++)
+    {
+	engine_seed(&dice[0], seed, 2 * (uint64_t)b);
+	engine_seed(&dice[1], seed, 2 * (uint64_t)b + 1);
+	engine_start(&f[0], &f[1], &dice[0]);
+	t = 0; // player 1 always starts first
+	while (1)
+	{
+	    // Players use a power move about half the time while they have one
+	    dmg = -1;
+	    if (f[t].pu > 0 && (engine_rand(&pick) & 1))
+		dmg = engine_powerup(&f[t], &f[!t], &dice[t]);
+	    if (dmg < 0)
+		engine_attack(&f[t], &f[!t], &dice[t]);
+	    turns++;
+	    if (engine_over(&f[!t]))
+		break;
+	    t = !t;
+	}
+	wins1 += (t == 0);
+    }
+    secs = now() - start;
+    printf("battles: %ld in %.3f s\n", battles, secs);
+    printf("battles/sec: %.0f\n", battles / secs);
+    printf("turns/sec: %.0f (%.2f turns per battle)\n", turns / secs, (double)turns / battles);
+    printf("player 1 wins: %.2f%%\n", 100.0 * wins1 / battles);
+    return 0;
+}
@@ -16,6 +16,13 @@
 // New matches may occur when a new client logs-in or when a match terminates normally or due to a client dropping.
 // Suitable partners should be searched starting from the beginning of the client list.
 // Once a match finishes, both partners should be moved to the end of client list.
+// (Waiting clients are kept on a ready queue in the order they became ready, and are paired
+// the moment they join it, so nothing is scanned while the lobby is idle)
+// (Players only meet players in their own room, see ROOMS below)
+// (Every player has an Elo rating, RATING0 to start, moved by each battle it finishes. The ready
+// queue is split into rating buckets (rating.c); a player is paired with the longest waiting
+// player of the nearest bucket within its search window, MATCHWIN points, widened by WIDENPTS
+// for every second it has waited. A player that finds nobody looks again every RETRYSECS)
 
 //------------------------------------------------------------------------------------------------------------------
 // COMBAT
@@ -41,6 +48,53 @@
 //------------------------------------------------------------------------------------------------------------------
 // The server must use select() and never block as it there are many matches going concurrently
 // and a new client might connect, yell, or drop.
+// (select() is now behind reactor.c, which uses epoll on Linux so that a wakeup only costs
+// as much as the number of ready descriptors, not the number of connected clients)
+// (A client gets LINERATE lines a second (-L) from a token bucket, lines past it are dropped
+// unhandled and a client that keeps flooding is disconnected; past -C connections a new one is
+// closed as it is accepted. The stats count what was shed, so a flood shows up there.)
+
+//------------------------------------------------------------------------------------------------------------------
+// SHARDS
+// With -t N the server runs N threads (shards). Each owns a listening socket bound with SO_REUSEPORT,
+// its own reactor, client table and matches; all the per-shard state below is __thread.
+// Players are handed between shards through lock-free queues (mpsc.c), never under a lock.
+
+//------------------------------------------------------------------------------------------------------------------
+// SPECTATORS
+// A named player who is not playing can send "watch <name>" to follow a battle in its room.
+// Each event of a watched battle is rendered once into a reference-counted frame, and the
+// frame is queued by reference on every spectator's output queue (no copy per spectator).
+// A spectator that has fallen behind skips frames rather than holding anything up, and one
+// that keeps skipping is disconnected. When the battle ends the spectators wait for a match.
+
+//------------------------------------------------------------------------------------------------------------------
+// ROOMS
+// A player who names itself is put in a room of at most -r players. Room r is hosted by shard
+// r % N, and room.c keeps one open room per shard: they take ROOMFILL players each in turn,
+// then every player goes to the open room with the fewest, so the matches are spread over the
+// shards. A player named on another shard than its room's is handed there at the end of the
+// loop iteration, and stays there. Matches and join/leave
+// announcements stay inside the room, so an arrival costs O(room size), not O(players).
+// A room's announcements are batched: each member gets everything announced in one loop
+// iteration as one message, queued just before the flush.
+
+//------------------------------------------------------------------------------------------------------------------
+// UPGRADE
+// With -U path a new binary can take over from a running one without dropping anyone: started
+// with the same -U, it connects to the old one, which stops every shard at the end of its loop
+// iteration, lets what is in flight finish, and sends its listeners and client sockets
+// (SCM_RIGHTS) with a snapshot of every client (upgrade.c). Once the new process has them the
+// old one exits; if anything fails the old one carries on. Clients don't notice either way.
+
+//------------------------------------------------------------------------------------------------------------------
+// SNAPSHOTS
+// With -k file every -K seconds the shards stop together at the end of a loop iteration, shard 0
+// forks and they all carry on; the child writes the named players and their matches out of its
+// copy-on-write image of the lists (snap.c). After a crash, --restore maps the last snapshot. The
+// sockets are gone with the process that crashed, so players come back by reconnecting: naming
+// itself as before gives a player its rating and room back, and two that were playing each other
+// carry on the battle where it was (the first back waits RESUMESECS for the other).
 
 //==================================================================================================================
 
@@ -59,8 +113,10 @@
 //============================================
 // Header Files
 //============================================
+#define _GNU_SOURCE // accept4()
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h> // offsetof
 #include <ctype.h>
 #include <string.h>
 #include <unistd.h>
@@ -72,54 +128,327 @@
 #include <sys/wait.h>
 #include <sys/socket.h>
 #include <sys/time.h>
+#include <sys/resource.h> // RLIMIT_NOFILE
+#include <sys/uio.h> // struct iovec
 #include <netinet/in.h>
 #include <arpa/inet.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdatomic.h> // nconns
+#include <limits.h> // INT_MAX
+#include <getopt.h> // getopt_long(), for --restore
+#include <sys/eventfd.h>
+#include "reactor.h" // reactor_add(), reactor_wait()...
+#include "mpsc.h" // lock-free queues between shards
+#include "engine.h" // the battle rules
+#include "stats.h" // counters and latency histograms
+#include "ring.h" // input buffering and line framing
+#include "uring.h" // the io_uring backend (-u)
+#include "timer.h" // deadlines
+#include "tmpl.h" // message templates
+#include "room.h" // room places
+#include "rating.h" // Elo ratings and rating buckets
+#include "rec.h" // traffic recording
+#include "upgrade.h" // handing everything to a new process
+#include "snap.h" // snapshots and crash recovery
 
 //============================================
 // Globals
 //============================================
 int port = PORT;
-static int listenfd; // There is only one battleserver
+static __thread int listenfd; // one listening socket per shard (SO_REUSEPORT)
 
-#define BACKLOG 10
+#define BACKLOG 1024 // default listen backlog (-b), the kernel caps it at net.core.somaxconn
+#define ACCEPTBUDGET 64 // default connections accepted per loop iteration (-a)
+static int backlog = BACKLOG; // connections the kernel queues for accept()
+static int acceptbudget = ACCEPTBUDGET; // the rest wait for the next loop iteration
+#define MAXEVENTS 256 // ready descriptors handled per reactor_wait()
+#define MAXSHARDS 64 // most threads -t accepts
+#define LOBBY 0 // the shard with the stats listener
 
 // For I/O
 #define MAXSTR 80
 #define MAXBUF 300 // good approximate
 #define MAXMSG 128 // for yell
 #define MAXNAME 40 // for name
+#define OUTSEG 512 // bytes per output segment (one turn's messages fit in one)
+#define MAXIOV 64 // segments written per writev()
+#define HIWAT (64 * 1024) // default output high-water mark in bytes
+static size_t hiwat = HIWAT; // a client with more unsent output than this is disconnected (-w)
+#define CAPACITY 1024 // default number of client records preallocated (split between shards)
+static int capacity = CAPACITY; // client records preallocated at startup (-c)
+static int statsport = 0; // local port for the stats listener, 0 if off (-s)
+static __thread int statsfd = -1; // the stats listener (shard 0 only)
+static int useuring = 0; // 1 if -u was given and the kernel has io_uring, else the reactor is used
+// Admission control and load shedding
+#define FDSPARE 64 // descriptors the connection cap leaves for listeners, eventfds, stats and files
+#define LINERATE 100 // default lines per second a client may send (a bot playing flat out sends about 50)
+#define BURSTSECS 2 // a quiet client may save up this many seconds of lines
+#define FLOODLINES 200 // a client that sends this many lines over its rate is disconnected
+static int maxconns = 0; // connections the server holds at once, the rest are closed on arrival
+			 // (-C, by default the descriptor limit less FDSPARE)
+static atomic_int nconns; // connections held by every shard together
+static int linerate = LINERATE; // 0 means no limit (-L)
+#define STATSBUF 65536 // largest stats snapshot
+#define ROOMSIZE 128 // default players per room
+static int roomsize = ROOMSIZE; // (-r)
+#define ANNBUF 2048 // announcements batched per room and loop iteration before they are sent early
+#define WATCHHIWAT (8 * 1024) // a spectator with more unsent output than this skips frames
+#define WATCHSKIPS 64 // a spectator that skips this many frames in a row is disconnected
+#define MATCHWIN 100 // rating points either side a player looks for an opponent at first
+#define WIDENPTS 100 // and the points its window grows by per second it has waited
+#define RETRYSECS 1 // how often a waiting player looks again
+
+// For Deadlines
+#define TICKMS 10 // timer wheel resolution in ms
+#define TICKNS ((uint64_t)TICKMS * 1000000)
+#define SECS(s) ((uint64_t)(s) * 1000 / TICKMS) // seconds in ticks
+#define NAMESECS 60 // default time to enter a name
+#define MOVESECS 60 // default time to play a turn
+#define IDLESECS 600 // default time a client may send nothing
+static int namesecs = NAMESECS; // 0 means no deadline (-n)
+static int movesecs = MOVESECS; // (-m)
+static int idlesecs = IDLESECS; // (-i)
+static __thread struct wheel wheel; // this shard's deadlines
+
+// For Combat (the rest is in engine.h)
+static unsigned int seedbase = 1; // every match rolls from seedbase and its id (-S)
+static __thread int matches; // matches started on this shard, the next one's id is self->id + nshards * matches
+
+// For Recording
+static char *recpath = NULL; // the recording of inbound traffic, NULL if off (-R)
+
+// For Upgrades
+static char *uppath = NULL; // the UNIX socket a new process takes over through, NULL if off (-U)
+static __thread int upfd = -1; // listening on uppath (shard 0 only)
+static __thread int freezing = 0; // 1 once this shard is to hand its clients over
+static __thread int accepting = 0; // 1 while a multishot accept is armed on listenfd (io_uring)
+static int upconn = -1; // the new process being handed to (shard 0)
+static int upresult; // 0 if the new process took everything
+// What the process before handed over, read by every shard as it starts
+static struct upbuf upin; // the snapshot and the descriptors
+static struct uphdr uph; // the snapshot's header
+static int *upmap = NULL; // upmap[fd there] is its fd here, -1 if there was none
+static int upmapn = 0; // slots in upmap
+static int upstatsfd = -1; // the stats listener handed over, -1 if none
+static int matchbase = 0; // match ids below this were used there
+static pthread_barrier_t stopbar; // where the shards meet to hand over, take over or fork
+
+// For Snapshots
+#define SNAPSECS 5 // default time between snapshots
+#define RESUMESECS 30 // a player back from a snapshot waits this long for its opponent
+static char *snappath = NULL; // where snapshots are written and restored from, NULL if off (-k)
+static int snapsecs = SNAPSECS; // (-K)
+static int restoring = 0; // 1 to restore snappath at startup (--restore)
+static __thread int snapping = 0; // 1 once this shard is to stop for a snapshot
+static __thread struct timer snaptimer; // the next snapshot (shard 0 only)
+static pid_t snappid = 0; // the child writing the last snapshot, 0 once it is reaped
+// The players of the restored snapshot, by record (a match's two records share a room,
+// so both slots are only touched by the shard hosting it)
+struct snapslot
+{
+    struct client *held; // the player back as this record, waiting for its opponent
+    int done; // 1 once that player stopped waiting (its match is not resumed)
+};
+static struct snapslot *slots = NULL; // one per record, NULL if nothing was restored
+
+struct client;
+
+// One event of a battle, rendered once and shared by the output queues of its spectators
+struct frame
+{
+    struct frame *next; // on the free list
+    int refs; // segments queued with it, plus one while it is being cast
+    int len; // bytes used in data
+    char data[OUTSEG];
+};
+
+// A chunk of output queued for a client, written out by flushclient()
+struct outseg
+{
+    struct outseg *next; // the next segment in the client's queue
+    char *buf; // the bytes to write: data, or a frame's data
+    struct frame *frame; // the frame buf points into (nothing is appended), NULL if buf is data
+    int len; // bytes used in buf
+    int off; // bytes of buf already written
+    char data[OUTSEG];
+};
+
+// Intrusive list links, so one client can sit on several lists at once
+// and be unlinked in O(1) without walking anything
+struct clink
+{
+    struct client *prev; // previous client on this list, NULL at the head
+    struct client *next; // next client on this list, NULL at the tail
+};
 
-// For Combat
-#define MAXATK 4 // 2-6 damage (add 2 in code)
-#define MAXHP 11 // 20-30 hp (add 20 in code)
-#define MAXPU 3 // 2-4 PU (add 2 in code)
+// A doubly linked list of clients threaded through a struct clink member
+struct clist
+{
+    struct client *head; // the first client (oldest)
+    struct client *tail; // the last client (newest)
+    size_t off; // offsetof() the struct clink member this list uses
+    int n; // number of clients on the list
+};
 
 // Structure for linked list of clients
+// The fields every event and every turn touch come first and fit in one cache line;
+// the input ring is only attached while a partial line is buffered (ring_get()),
+// so a connection sitting idle costs the record and nothing else
 struct client
 {
+    //----- Hot -----
     int fd; // the file descriptor of the client
-    struct in_addr ipaddr; // the address of the client
-    // Input/Output
-    char buf[MAXBUF];  // the buffer stored in this client's fd
-    int bytesleft;  // how many data bytes in buf (after nextpos)
-    char *nextpos; // next position to read from buf
-		 // if non-NULL, move this down to buf[0] before reading
-    char name[MAXNAME+1];  // name[0]==0 means no name yet
-    // Combat Variables
     int nowfd; // the fd that the player is currently playing
-    int lastfd; // the file descriptor that the client last played with
-    int ready; // determine if the child is ready to be compared to play
-	      // 1 if it is (not in a game but is still in server)
-	      // 0 if it is not (currently in a game)
-    int turn; // 1 if it's this client's turn, attack (write)
+    struct fighter ft; // hit points and power ups
+    unsigned char turn; // 1 if it's this client's turn, attack (write)
 	      // 0 if it's not this client's turn (read), defend
-    int yell; // 1 if this client can yell
+    unsigned char yell; // 1 if this client can yell
 	      // 0 if this client can't yell
-    int hp; // number of hit points
-    int pu; // number of power ups
-    // Linked list pointer
-    struct client *next; // a pointer to the next client in the linked list
-} *top = NULL; // the top (head) client initializes as NULL
+    unsigned char ready; // determine if the child is ready to be compared to play
+	      // 1 if it is (not in a game but is still in server)
+	      // 0 if it is not (currently in a game)
+    unsigned char queued; // 1 if on the ready queue (named, ready and waiting for an opponent)
+    unsigned char dirty; // 1 if on the flush list
+    unsigned char wantwrite; // 1 if the reactor is watching fd for RE_WRITE
+    unsigned char overflow; // 1 if opending passed hiwat, p is dropped at the next flush
+    unsigned char inroom; // 1 once p is on its room's member list (on the room's shard)
+    struct ring *in; // input read from fd but not yet handled, NULL if there is none
+    // Output queue
+    struct outseg *ohead; // the oldest unwritten segment, NULL if nothing is queued
+    struct outseg *otail; // the segment new messages are appended to
+    size_t opending; // bytes queued but not yet written
+    uint64_t heard; // the tick p last sent something
+    //----- Lists -----
+    struct clink link; // position in the clients list (iteration order for fairness)
+    struct clink rlink; // position in its room's ready queue (its rating bucket)
+    struct clink flink; // position in the flush list
+    struct clink mlink; // position in the room's member list
+    struct clink hlink; // position in the handoff list
+    //----- Cold -----
+    int lastfd; // the file descriptor that the client last played with
+    int rating; // Elo rating, for as long as p is connected
+    int bucket; // the bucket p waits in, while queued
+    int room; // the room p was put in when named, -1 before
+    int handto; // the shard p is handed to at the end of this iteration, -1 if none
+    int namelen; // strlen(name), so messages don't measure it again
+    uint64_t since; // the tick p joined the ready queue
+    // io_uring (-u)
+    int inflight; // operations queued on fd that will complete again
+    int sending; // sends in the chain in flight
+    struct outseg *sendtail; // the last segment the chain sends, nothing is appended to it
+    unsigned char recving; // 1 while a multishot receive is armed on fd
+    unsigned char leaving; // 1 once fd's operations were cancelled so p can be handed to another shard
+    unsigned char closing; // 1 if p is freed (and fd closed) when inflight drops to 0
+    // Deadlines (armed only while p is attached to a shard)
+    struct timer deadline; // to enter a name, or to play while it is p's turn
+    struct timer idle; // checks for silence every idlesecs
+    struct timer retry; // looks for an opponent again while p waits
+    // Spectators
+    struct client *watching; // the player p is watching, NULL if none
+    struct clink wlink; // position in that player's watchers
+    struct clist watchers; // the spectators watching p (only while p plays)
+    int skips; // frames p skipped in a row for being behind
+    int credit; // lines p may send right now, in SECS(1)ths of a line (below 0 once it sends too many)
+    uint32_t recid; // the connection's id in the recording (-R)
+    int matchid; // the match p plays or last played, unique across shards
+    struct rng dice; // p's rolls in that match, seeded from seedbase and matchid
+    const struct snaprec *resume; // p's record in the restored snapshot, until its match resumes or not
+    char name[MAXNAME+1];  // name[0]==0 means no name yet
+};
+
+// io_uring operations carry what they are for in the low 3 bits of their data,
+// and the client (or for the listeners, the fd) in the rest
+#define UK_ACCEPT 1 // listenfd
+#define UK_POLL 2 // the inbox eventfd or the stats listener became readable
+#define UK_RECV 3 // input from a client
+#define UK_SEND 4 // one segment of a client's output sent
+#define UTAG(p, kind) ((uint64_t)(uintptr_t)(p) | (kind))
+#define UPOLLTAG(fd) (((uint64_t)(fd) << 3) | UK_POLL)
+#define UKIND(data) ((int)((data) & 7))
+#define UCLIENT(data) ((struct client *)(uintptr_t)((data) & ~(uint64_t)7))
+#define UFD(data) ((int)((data) >> 3))
+
+// All clients, in arrival order, requeue() moves a client to the tail
+static __thread struct clist clients = { NULL, NULL, offsetof(struct client, link), 0 };
+
+// A room, on the shard that hosts it
+struct room
+{
+    struct clist members; // the named players in the room
+    // Members waiting for an opponent, by rating bucket, oldest first in each
+    // Two of them may be further apart than their windows, or be the pair blocked by lastfd
+    struct clist ready[NBUCKETS];
+    struct ladder ladder; // which of ready are not empty
+    int annlen; // bytes in ann
+    int pending; // 1 if on the list of rooms with announcements pending
+    int annnext; // the next room on that list (an id), -1 at the end
+    char ann[ANNBUF]; // this loop iteration's announcements
+};
+
+// The rooms this shard hosts, rooms[id / nshards] for room id
+static __thread struct room *rooms = NULL;
+static __thread int roomcap = 0; // slots in rooms
+static __thread int annhead = -1; // the first room with announcements pending, -1 if none
+static __thread int nwaiting = 0; // clients on a ready queue
+
+// Clients with output queued during this loop iteration
+static __thread struct clist flushq = { NULL, NULL, offsetof(struct client, flink), 0 };
+
+// Clients leaving this shard at the end of this loop iteration
+static __thread struct clist handq = { NULL, NULL, offsetof(struct client, hlink), 0 };
+
+// Free output segments, reused before malloc()
+static __thread struct outseg *segfree = NULL;
+static __thread struct frame *framefree = NULL; // likewise for frames
+static __thread int nwatching = 0; // clients watching a battle
+
+// Free client records, linked through link.next
+// Records come from slabs allocated in one piece, and the most recently freed
+// (still in cache) is handed out first
+static __thread struct client *clfree = NULL;
+static __thread int slabsize = 0; // records per slab on this shard
+
+// Dense table of clients indexed by fd, so getclient() is a single array access
+static __thread struct client **fdtab = NULL;
+static __thread int fdcap = 0; // number of slots in fdtab
+
+//===========
+// Shards
+//===========
+#define XCLIENT 1 // a player for one of the shard's rooms
+#define XTEXT 2 // an announcement for one of the shard's rooms
+#define XUPGRADE 3 // hand every client over to a new process (-U)
+#define XSNAP 4 // stop for a snapshot at the end of this loop iteration (-k)
+
+// A message from one shard to another
+struct xmsg
+{
+    struct mpsc_node node; // must be first, the inbox links through it
+    int kind; // XCLIENT, XTEXT, XUPGRADE or XSNAP
+    struct client *p1; // the player handed over (XCLIENT)
+    int room; // the room text is for (XTEXT)
+    int len; // length of text
+    char text[MAXSTR]; // the announcement (XTEXT)
+};
+
+struct shard
+{
+    int id; // index in shards[]
+    struct stats *stats; // this shard's counters, NULL until it starts
+    int evfd; // eventfd that wakes the shard when something is pushed on its inbox
+    struct mpsc inbox; // messages from other shards
+    int listenfd; // its listener, -1 until it runs (or the one handed over for it)
+    struct upbuf up; // its clients, while they are handed over
+    int nextmatch; // the id its next match would have had, likewise
+    struct clist *clients; // its client list and match count, for the snapshot child
+    int *matches;
+};
+
+static struct shard shards[MAXSHARDS];
+static int nshards = 1; // number of shard threads (-t)
+static __thread struct shard *self; // the shard this thread runs
+static __thread struct stats st; // this shard's counters, only this thread writes them
 
 //===========
 // Messages
@@ -130,7 +459,7 @@ static char waitmsg[] =
 	"Waiting for an opponent \r\n";
 static char beginbattle[] =
 	"Player %s battles Player %s \r\n"
-	"Let the battles begin! \r\n";
+	"Let the battles begin! (match %d) \r\n";
 static char moves1[] =
         "Here are your list of options,\r\n"
         "(a)ttack, (y)ell, (p)owermove\r\n";
@@ -151,38 +480,164 @@ static char loser[] =
 	"Unfortunately, you have lost. \r\n";
 static char yelled[] =
 	"Player %s yelled: %s \r\n";
+static char entered[] =
+	"Player %s has entered the arena. \r\n";
+static char left[] =
+	"Player %s has left the arena\r\n";
+static char namedeadline[] =
+	"Too slow to enter a name, goodbye. \r\n";
+static char movedeadline[] =
+	"Time is up! You forfeit this battle. \r\n";
+static char opponentdeadline[] =
+	"Your opponent ran out of time. \r\n";
+static char idledeadline[] =
+	"Disconnected for inactivity. \r\n";
+static char floodmsg[] =
+	"Too many commands, goodbye. \r\n";
+static char fullmsg[] =
+	"The arena is full, try again later. \r\n";
+static char watchmsg[] =
+	"You are watching player %s \r\n";
+static char nowatchmsg[] =
+	"Player %s is not in a battle here \r\n";
+static char watchhp[] =
+	"Player %s has hp: %d, player %s has hp: %d \r\n";
+static char watchwon[] =
+	"Player %s has won the battle \r\n";
+static char resumebattle[] =
+	"Player %s battles Player %s \r\n"
+	"The battle resumes! (match %d) \r\n";
+static char resumewait[] =
+	"Welcome back! Waiting for your opponent to come back \r\n";
+
+// The messages with names or numbers in them, compiled in main()
+static struct tmpl tbegin, tdamage, tremains, tenemy, tyelled, tentered, tleft;
+static struct tmpl twatch, tnowatch, twatchhp, twatchwon, tresume;
 
 //============================================
 // Function Prototypes
 //============================================
 // Helper Functions
-char* extractline(char *s, int limit); // a special form of strchr() with limit
 static void read_process(struct client *p); // process the client if there is something to read
-char* myreadline(struct client *p); // read a line
-void cleanup(struct client *p); // clean up client p
+static int process_input(struct client *p); // handle every complete line in p's ring
+static void deliver(struct client *p, const char *buf, size_t n); // add received bytes to p's ring and handle them
+static void putring(struct client *p); // give p's ring back if it is empty
+static int credit(int credit, uint64_t ticks); // p's line credit, ticks later
+static int process_line(struct client *p, char *s); // handle one line from p
 void setup(); // setup the socket
-void newconnection(); // receives a new connection from a client
-static void broadcast(char *s, int size); // broadcast the message to everyone
+static void statssetup(void); // open the stats listener
+static void sendstats(void); // answer one stats connection with a snapshot
+static int newconnection(void); // accept the waiting connections, up to acceptbudget
+static void newclient(int fd); // add the client on fd and greet it
+static void roomcast(int room, const char *s, int size); // announce s to everyone in room
+static struct room *getroom(int id); // the state of room id, hosted by this shard
+static void joinroom(struct client *p); // add p to its room's members and announce it
+static void flushrooms(void); // queue each room's batched announcements for its members
+static void dropclient(struct client *p); // end p's game, announce and remove p
 void unix_error(char *msg); // a function to exit when error occurs
+static void usage(char *prog); // print the command line options and exit
 
 //--------------------------------------------
 // Client Functions
-static void addclient(int fd);
+static void clist_append(struct clist *l, struct client *p); // add p to the tail of l
+static void clist_remove(struct clist *l, struct client *p); // unlink p from l
+static void pool_grow(int n); // add a slab of n client records to the free list
+static struct client *pool_get(void); // take a client record off the free list
+static void pool_put(struct client *p); // return a client record to the free list
+static struct client *addclient(int fd);
 static void removeclient(struct client *p);
 struct client *getclient(int fd);
 static void requeue(struct client *p);
+static void ready_join(struct client *p); // match p or put p on the ready queue
+static struct client *nearest(struct client *p); // the closest waiting opponent in p's window
+static void enqueue(struct client *p); // put p in its rating bucket
+static void dequeue(struct client *p); // take p out of its rating bucket
+static int attach(struct client *p); // index and watch p on this shard
+static void detach(struct client *p); // undo attach(), keeping p's fd open
+static void freeclient(struct client *p); // close and free a detached client
+
+//--------------------------------------------
+// Shard Functions
+static void *serve(void *arg); // run one shard's game loop
+static uint64_t reactor_events(int timeout); // wait for and handle ready descriptors
+static uint64_t uring_events(int timeout); // wait for and handle io_uring completions
+static void post(int to, struct xmsg *m); // push m on shard to's inbox
+static void handoff(void); // send the clients on handq to their shards
+static void receive(void); // handle the messages on this shard's inbox
+
+//--------------------------------------------
+// Upgrade Functions
+static int takeover(void); // take the sockets and clients of the server on uppath, if it runs
+static const char *uprecord(const char *at, const char *end, struct upclient *u); // read one record, returns the next
+static int upowner(const struct upclient *u, uint32_t k); // the shard that takes record k
+static int upfdof(int fd); // the fd here of what was fd there, -1 if none
+static void restore(void); // take this shard's clients from the snapshot
+static void upsetup(void); // listen on uppath for the next upgrade
+static void startupgrade(void); // a new process connected, stop every shard
+static void handover(void); // hand this shard's clients over, with every other shard
+static void drain(void); // wait for the operations in flight to finish (io_uring)
+static void snapshot(struct upbuf *b); // write this shard's clients into b
+static int sendall(void); // send every shard's snapshot to the new process
+static void resume(void); // carry on after a handover that failed
+
+//--------------------------------------------
+// Snapshot Functions
+static void snapfired(struct timer *t); // time for a snapshot, stop every shard
+static void snapstop(void); // stop with every shard while shard 0 forks
+static int snapwrite(void); // write every shard's players out (in the child)
+static void snaprestore(void); // map the snapshot on snappath and index it (--restore)
+static int rejoin(struct client *p); // resume p's match from the snapshot, or wait for its opponent
+static void unhold(struct client *p); // p stops waiting for its opponent from the snapshot
+
+//--------------------------------------------
+// Timer Functions
+static int nexttimeout(void); // ms until a deadline may be due, -1 if none is armed
+static void startclock(struct client *p); // give p movesecs to play its turn
+static void deadline_fired(struct timer *t); // a client didn't name itself or move in time
+static void idle_fired(struct timer *t); // a client may have been silent for idlesecs
+static void retry_fired(struct timer *t); // a waiting client looks for an opponent again
+static void farewell(struct client *p, const char *s); // tell a client that is dropped why
 
 //--------------------------------------------
 // Battle Functions
 int matchup(struct client *p1, struct client *p2); // This function returns 1 if both clients can match up and 0 otherwise
 void initialize_match(struct client *p1, struct client *p2);
+static void resume_match(struct client *p1, struct client *p2, const struct snaprec *r1, const struct snaprec *r2); // carry on their match from the snapshot
+static void openmatch(struct client *p1, struct client *p2, const struct tmpl *t); // the messages a match starts with
 void attack(struct client *p1, struct client *p2);
 int powerup(struct client *p1, struct client *p2); // Return 1 if successful, 0 if not (no powerups left)
+static void turnreport(struct client *p1, struct client *p2, int dmg); // tell both what p1's turn did
 void yell(struct client *p1);
-int normaldmg();
-int powerdmg();
 void endgame(struct client *p1, struct client *p2);
 
+//--------------------------------------------
+// Spectator Functions
+static void watch(struct client *p, const char *name); // make p a spectator of name's battle
+static void unwatch(struct client *p); // stop p watching, p is not put back to waiting
+static void endwatch(struct client *p, struct frame *f); // send f to p's spectators and let them go
+static int watched(struct client *p1, struct client *p2); // 1 if either player has spectators
+static struct frame *frame_get(void); // an empty frame, held once by the caller
+static void frame_add(struct frame *f, const struct tmpl *t, const struct targ *a); // render t onto f
+static void frame_put(struct frame *f); // drop one hold on f
+static void watchcast(struct client *p1, struct client *p2, struct frame *f); // queue f for both players' spectators
+
+//--------------------------------------------
+// Output Functions
+static void queuemsg(struct client *p, const char *s, size_t n); // queue n bytes for p
+#define queuestr(p, s) queuemsg((p), (s), sizeof(s) - 1) // queue one of the fixed messages (a char array)
+static void queuetmpl(struct client *p, struct client *q, const struct tmpl *t, const struct targ *a); // render t into p's queue (and copy it to q's)
+static char *queuespace(struct client *p, size_t n); // room for n contiguous bytes at the end of p's queue
+static void queuecommit(struct client *p, size_t n); // n bytes were written at queuespace()
+static struct outseg *newseg(struct client *p); // append an empty segment to p's queue
+static void segput(struct outseg *seg); // free a written (or discarded) segment
+static void queueframe(struct client *p, struct frame *f); // queue f by reference, or skip it if p is behind
+static int hiwatok(struct client *p, size_t n); // 0 (and p is dropped at the flush) if n more bytes pass hiwat
+static int flushclient(struct client *p); // write p's queue, returns -1 on error
+static void flushall(void); // flush every client with queued output
+static void sendchain(struct client *p); // queue p's output as linked sends (io_uring)
+static void sent(struct client *p, int res); // one linked send completed (io_uring)
+static int quiesce(struct client *p); // cancel p's operations, returns 1 once none are in flight
+
 //--------------------------------------------
 // Server Functions
 int Accept(int fd, struct sockaddr *sa, socklen_t *salenptr);
@@ -196,7 +651,9 @@ void Close(int fd);
 //--------------------------------------------
 // Input/Output Functions
 ssize_t Writen(int fd, void *ptr, size_t nbytes); // defined in writen.c
+ssize_t Writev(int fd, const struct iovec *iov, int iovcnt); // defined in writen.c
 ssize_t Readn(int fd, void *ptr, size_t nbytes); // defined in readen.c
+ssize_t Readv(int fd, const struct iovec *iov, int iovcnt); // defined in readn.c
 
 //============================================
 // Main Function
@@ -207,71 +664,415 @@ int main(int argc, char **argv)
     //-------------------------------------------------------
     // Initialize
     //-------------------------------------------------------
+    pthread_t tid;
+    struct rlimit rl;
+    int i, c;
+    static struct option longopts[] = {
+	{ "restore", no_argument, &restoring, 1 }, // sets restoring, getopt_long() returns 0
+	{ NULL, 0, NULL, 0 }
+    };
+    // Command line options
+    while ((c = getopt_long(argc, argv, "a:b:c:C:i:k:K:L:m:n:r:R:s:S:t:uU:w:", longopts, NULL)) != -1)
+    {
+	switch (c)
+	{
+	case 0: // --restore
+	    break;
+	case 'a': // accept budget
+	    acceptbudget = atoi(optarg);
+	    if (acceptbudget < 1)
+		usage(argv[0]);
+	    break;
+	case 'b': // listen backlog
+	    backlog = atoi(optarg);
+	    if (backlog < 1)
+		usage(argv[0]);
+	    break;
+	case 'r': // room size
+	    roomsize = atoi(optarg);
+	    if (roomsize < 2)
+		usage(argv[0]);
+	    break;
+	case 'c': // client records to preallocate
+	    capacity = atoi(optarg);
+	    if (capacity < 1)
+		usage(argv[0]);
+	    break;
+	case 'C': // connection cap
+	    maxconns = atoi(optarg);
+	    if (maxconns < 1)
+		usage(argv[0]);
+	    break;
+	case 'i': // idle disconnect
+	    idlesecs = atoi(optarg);
+	    if (idlesecs < 0)
+		usage(argv[0]);
+	    break;
+	case 'k': // snapshot file
+	    snappath = optarg;
+	    break;
+	case 'K': // time between snapshots
+	    snapsecs = atoi(optarg);
+	    if (snapsecs < 1)
+		usage(argv[0]);
+	    break;
+	case 'L': // lines per second per client
+	    linerate = atoi(optarg);
+	    if (linerate < 0)
+		usage(argv[0]);
+	    break;
+	case 'm': // time to play a turn
+	    movesecs = atoi(optarg);
+	    if (movesecs < 0)
+		usage(argv[0]);
+	    break;
+	case 'n': // time to enter a name
+	    namesecs = atoi(optarg);
+	    if (namesecs < 0)
+		usage(argv[0]);
+	    break;
+	case 'R': // record inbound traffic
+	    recpath = optarg;
+	    break;
+	case 'S': // seed
+	    seedbase = strtoul(optarg, NULL, 10);
+	    break;
+	case 's': // stats port
+	    statsport = atoi(optarg);
+	    if (statsport < 1 || statsport > 65535)
+		usage(argv[0]);
+	    break;
+	case 't': // number of shard threads
+	    nshards = atoi(optarg);
+	    if (nshards < 1 || nshards > MAXSHARDS)
+		usage(argv[0]);
+	    break;
+	case 'u': // io_uring instead of epoll/select
+	    useuring = 1;
+	    break;
+	case 'U': // hot upgrade socket
+	    uppath = optarg;
+	    break;
+	case 'w': // output high-water mark
+	    hiwat = strtoul(optarg, NULL, 10);
+	    if (hiwat == 0)
+		usage(argv[0]);
+	    break;
+	default:
+	    usage(argv[0]);
+	}
+    }
+    if (restoring && !snappath)
+	usage(argv[0]); // nothing to restore from
+    (void)signal(SIGPIPE, SIG_IGN); // Ignore SIGPIPE, will read terminated with EOF and EPIPE
+    // Allow as many connections as the hard limit on descriptors does
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max)
+    {
+	rl.rlim_cur = rl.rlim_max;
+	setrlimit(RLIMIT_NOFILE, &rl);
+    }
+    // Past the descriptor limit accept() fails and connections pile up in the backlog,
+    // so by default the server turns them away a little before it
+    if (!maxconns && getrlimit(RLIMIT_NOFILE, &rl) == 0)
+	maxconns = rl.rlim_cur == RLIM_INFINITY || rl.rlim_cur > INT_MAX ? INT_MAX :
+		rl.rlim_cur > 2 * FDSPARE ? (int)rl.rlim_cur - FDSPARE : (int)rl.rlim_cur / 2;
+    if (!maxconns)
+	maxconns = INT_MAX;
+    for (i = 0; i < MAXSHARDS; i++)
+	shards[i].listenfd = -1;
+    // A server already running on uppath hands everything over (this sets nshards)
+    if (uppath && takeover() < 0)
+	exit(1);
+    room_init(roomsize, nshards);
+    if (uppath || snappath)
+	pthread_barrier_init(&stopbar, NULL, nshards);
+    // Players of the last snapshot come back by name (not if clients were just taken over)
+    if (restoring && !upin.data)
+	snaprestore();
+    if (recpath && rec_start(recpath, seedbase, nshards) < 0)
+	unix_error(recpath);
+    // Split the messages into their fixed parts once (each fits in one output segment)
+    tmpl_compile(&tbegin, beginbattle, MAXNAME);
+    tmpl_compile(&tdamage, damage, MAXNAME);
+    tmpl_compile(&tremains, remains, 0);
+    tmpl_compile(&tenemy, enemyremains, 0);
+    tmpl_compile(&tyelled, yelled, MAXMSG);
+    tmpl_compile(&tentered, entered, MAXNAME);
+    tmpl_compile(&tleft, left, MAXNAME);
+    tmpl_compile(&twatch, watchmsg, MAXNAME);
+    tmpl_compile(&tnowatch, nowatchmsg, MAXMSG);
+    tmpl_compile(&twatchhp, watchhp, MAXNAME);
+    tmpl_compile(&twatchwon, watchwon, MAXNAME);
+    tmpl_compile(&tresume, resumebattle, MAXNAME);
+    // Fall back to the reactor if this kernel can't (the main thread keeps the ring for shard 0)
+    if (useuring && uring_init() < 0)
+    {
+	fprintf(stderr, "io_uring unavailable (%s), using the reactor\n", strerror(errno));
+	useuring = 0;
+    }
+    // Every inbox exists before any shard runs, so shards can post to each other right away
+    for (i = 0; i < nshards; i++)
+    {
+	shards[i].id = i;
+	atomic_init(&shards[i].inbox.head, NULL);
+	if ((shards[i].evfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0)
+	    unix_error("eventfd");
+    }
+    for (i = 1; i < nshards; i++)
+    {
+	if ((c = pthread_create(&tid, NULL, serve, &shards[i])) != 0)
+	{
+	    fprintf(stderr, "pthread_create: %s\n", strerror(c));
+	    exit(1);
+	}
+    }
+    serve(&shards[LOBBY]); // the main thread is shard 0
+    return 0;
+}
+
+//--------------------------------------------------------------------------------------
+
+// This function runs the game loop of one shard
+static void *serve(void *arg)
+{
     // Initialize local variables
-    struct client *p, *nextp; // 2 pointers for the linked list
-    struct client *p1, *p2; // for matchup()
+    uint64_t t0, t1; // for the stats
+    self = arg;
+    self->stats = &st;
+    rec_thread(self->id);
+    wheel_init(&wheel, stats_now() / TICKNS);
+    matches = (matchbase + nshards - 1) / nshards; // so every id here is new
+    self->clients = &clients;
+    self->matches = &matches;
     // Set Up
     setup(); // modifies the listenfd static variable (aborts on error)
 	// will accept at newconnection() in Client Handling Loop
+    if (statsport && self->id == LOBBY)
+	statssetup();
+    if (upin.data) // clients handed over by the process before
+    {
+	restore();
+	pthread_barrier_wait(&stopbar); // every shard has its clients
+	if (self->id == LOBBY)
+	{
+	    upbuf_free(&upin);
+	    free(upmap);
+	}
+    }
+    if (uppath && self->id == LOBBY)
+	upsetup();
+    if (snappath && self->id == LOBBY)
+    {
+	timer_init(&snaptimer, snapfired);
+	timer_arm(&wheel, &snaptimer, SECS(snapsecs));
+    }
     //-------------------------------------------------------
     // Client Handling Loop / Game Loop
     //-------------------------------------------------------
     while(1) // server exits by getting signaled
     {
-	// Check Matchup & Initialize if match exists
-	for(p1 = top; p1; p1=p1->next)
-	{
-	    for( p2 = p1->next ; p2 ; p2=p2->next)
-	    {
-		// If there is a match,
-		// initialize the game.
-		// Read_process() will handle the game play
-		if (p1->name[0] && p2->name[0]) // both must have a name
-		{
-		    if (matchup(p1, p2)) // if both players can be matched up
-		    {
-			initialize_match(p1, p2);
-		    }
-		}
-	    }
-	}
+	// Matches are made by ready_join() when a client names itself or a match ends,
+	// read_process() will handle the game play
 	//---------------------------------------------------
 	// FDs Handling (the current clients in the server)
 	//---------------------------------------------------
-   	// Note: fdlist reinitializes every loop for select()
-	// Initialize file descriptor lists
-        fd_set fdlist;
-	// Need to know maxfd for select()
-        int maxfd = listenfd;
-        FD_ZERO(&fdlist); // clears the set
-        FD_SET(listenfd, &fdlist); // adds listenfd (host) to fdlist
-        for (p = top; p; p = p->next) // NULL at end of linked list
-        {
-            FD_SET(p->fd, &fdlist); // include everything into the fdlist
-            if (p->fd > maxfd)
-                maxfd = p->fd; // update maxfd
-        }
-        //===================================================
-        // Select()
-        //===================================================
-        if ((select(maxfd + 1, &fdlist, NULL, NULL, NULL)) < 0) // returns -1 on error, 0 if timeout, and file descriptor
-        {	// (numfd, readfd, writefd, exceptfd, timeval)
-            perror("select");
-	}
-	// No error occured, process select options
+	// Clients are registered once in addclient() and removed in removeclient(),
+	// so there is no fd_set to rebuild here.
+	// The wait ends by the time the next deadline is due
+	t1 = useuring ? uring_events(nexttimeout()) : reactor_events(nexttimeout()); // returns when the wait ended
+	// Everything queued while handling these events goes out now,
+	// one writev() (or one chain of linked sends) per client
+	t0 = stats_now();
+	flushrooms(); // this iteration's announcements, one message per member
+	flushall();
+	hist_add(&st.flush, stats_now() - t0);
+	rec_flush(); // what came in this iteration, if recording
+	// Players just named for a room on another shard go there
+	handoff();
+	if (snapping) // shard 0 forks for a snapshot (-k)
+	    snapstop();
+	if (freezing) // a new process is taking over (-U)
+	    handover();
+	st.busyns += stats_now() - t1;
+	st.loops++;
+	st.connected = clients.n;
+	st.waiting = nwaiting;
+	st.watching = nwatching;
+    } // End of While Loop
+    return NULL;
+}
+
+//--------------------------------------------------------------------------------------
+
+// This function waits for ready descriptors (at most timeout ms) and handles them
+// Deadlines that passed while waiting are handled first
+// It returns the time the wait ended
+static uint64_t reactor_events(int timeout)
+{
+    struct client *p; // the client an event is for
+    struct revent ev[MAXEVENTS]; // ready descriptors
+    int i, nready, newconn;
+    uint64_t t0, t1;
+    //===================================================
+    // reactor_wait() (epoll, or select() as a fallback)
+    //===================================================
+    t0 = stats_now();
+    if ((nready = reactor_wait(ev, MAXEVENTS, timeout)) < 0) // returns -1 on error, or the number of ready fds
+	unix_error("reactor_wait");
+    t1 = stats_now();
+    st.waitns += t1 - t0;
+    wheel_advance(&wheel, t1 / TICKNS);
+    newconn = 0;
+    for (i = 0; i < nready; i++)
+    {
 	// If listenfd has read, it means there is a new connection
-	if (FD_ISSET(listenfd, &fdlist)) // connect if new client is connecting
-	    // If the host socket is still in the fdlist
-	    newconnection();// accept connection & update linked list
-        // All Clients
-	for (p = top; p; p = nextp)
+	if (ev[i].fd == listenfd)
 	{
-	    nextp = p->next;  // in case we remove this client because of error
-	    if (FD_ISSET(p->fd, &fdlist)) // if this client has buffer's to read
-		read_process(p); // read & process it
+	    newconn = 1;
+	    continue;
 	}
-    } // End of While Loop
-    return 0;
+	// Another shard pushed something on our inbox
+	if (ev[i].fd == self->evfd)
+	{
+	    receive();
+	    continue;
+	}
+	// Someone asked for a stats snapshot
+	if (ev[i].fd == statsfd)
+	{
+	    sendstats();
+	    continue;
+	}
+	// A new process wants to take over
+	if (ev[i].fd == upfd)
+	{
+	    startupgrade();
+	    continue;
+	}
+	// A client that was removed earlier in this batch is not found
+	if ((p = getclient(ev[i].fd)) && (ev[i].events & RE_READ))
+	    read_process(p); // read & process it
+	// The socket drained, so queued output can go out (p may have been removed above)
+	if ((p = getclient(ev[i].fd)) && (ev[i].events & RE_WRITE) && !p->dirty)
+	{
+	    clist_append(&flushq, p);
+	    p->dirty = 1;
+	}
+    }
+    // Accept after the clients, so a new client can't reuse the fd of a client
+    // removed above and receive its stale event
+    if (newconn)
+    {
+	t0 = stats_now();
+	newconnection(); // accept connections & update linked list
+	hist_add(&st.accept, stats_now() - t0);
+    }
+    return t1;
+}
+
+//--------------------------------------------------------------------------------------
+
+// This function waits for io_uring completions (at most timeout ms) and handles them,
+// after the deadlines that passed while waiting
+// Clients' operations carry the client, so a completion can't be mistaken for another
+// client's even if the fd was reused; a client with operations in flight is not freed
+// (and its fd not closed) until they have all completed
+// It returns the time the wait ended
+static uint64_t uring_events(int timeout)
+{
+    struct ucomp c[MAXEVENTS]; // completions
+    struct client *p;
+    int i, n, more;
+    uint64_t t0, t1;
+    t0 = stats_now();
+    if ((n = uring_wait(c, MAXEVENTS, timeout)) < 0)
+	unix_error("uring_wait");
+    t1 = stats_now();
+    st.waitns += t1 - t0;
+    wheel_advance(&wheel, t1 / TICKNS);
+    for (i = 0; i < n; i++)
+    {
+	more = uring_more(&c[i]);
+	switch (UKIND(c[i].data))
+	{
+	case UK_ACCEPT: // a new connection, already accepted
+	    if (c[i].res >= 0)
+	    {
+		t0 = stats_now();
+		newclient(c[i].res);
+		hist_add(&st.accept, stats_now() - t0);
+	    }
+	    else if (c[i].res != -ECANCELED)
+		fprintf(stderr, "accept error: %s\n", strerror(-c[i].res));
+	    if (!more)
+	    {
+		accepting = 0;
+		if (!freezing) // cancelled by drain()
+		{
+		    uring_accept(listenfd, UK_ACCEPT);
+		    accepting = 1;
+		}
+	    }
+	    break;
+	case UK_POLL: // the inbox, the stats listener or the upgrade listener is readable
+	    if (UFD(c[i].data) == self->evfd)
+		receive();
+	    else if (UFD(c[i].data) == statsfd)
+		sendstats();
+	    else if (UFD(c[i].data) == upfd)
+		startupgrade();
+	    if (!more)
+		uring_poll(UFD(c[i].data), c[i].data);
+	    break;
+	case UK_RECV: // input from a client
+	    p = UCLIENT(c[i].data);
+	    if (c[i].res > 0 && !p->closing)
+	    {
+		st.bytesin += c[i].res;
+		deliver(p, uring_buf(&c[i]), c[i].res);
+	    }
+	    uring_putbuf(&c[i]);
+	    if (more)
+		break;
+	    p->inflight--;
+	    p->recving = 0;
+	    if (p->closing)
+	    {
+		freeclient(p); // if this was the last operation
+		break;
+	    }
+	    // End of file or a failed connection drops p, running out of buffers just rearms
+	    if (c[i].res == 0 || (c[i].res < 0 && c[i].res != -ENOBUFS && c[i].res != -ECANCELED))
+		dropclient(p);
+	    else if (!p->leaving)
+	    {
+		uring_recv(p->fd, UTAG(p, UK_RECV));
+		p->inflight++;
+		p->recving = 1;
+	    }
+	    break;
+	case UK_SEND: // one segment of a chain of sends, in the order they were queued
+	    p = UCLIENT(c[i].data);
+	    sent(p, c[i].res);
+	    p->inflight--;
+	    if (!--p->sending)
+		p->sendtail = NULL; // the chain is over, its last segment can take more output
+	    if (p->closing)
+	    {
+		freeclient(p);
+		break;
+	    }
+	    if (c[i].res < 0 && c[i].res != -ECANCELED)
+		dropclient(p); // the connection failed
+	    else if (!p->sending && p->ohead && !p->leaving && !p->dirty)
+	    {
+		clist_append(&flushq, p); // more was queued while the chain was in flight
+		p->dirty = 1;
+	    }
+	    break;
+	}
+    }
+    return t1;
 }
 
 //============================================
@@ -283,30 +1084,229 @@ void setup()  // bind and listen, abort on error
 {
     // Initalize the socket address
     struct sockaddr_in r;
-    (void)signal(SIGPIPE, SIG_IGN); // Ignore SIGPIPE, will read terminated with EOF and EPIPE
-    // Socket
-    listenfd = Socket(AF_INET, SOCK_STREAM, 0); // will exit if error
-    memset(&r, '\0', sizeof(r));
-    r.sin_family = AF_INET;
-    r.sin_addr.s_addr = INADDR_ANY;
-    r.sin_port = htons(port); // might be PORT instead, depending on define above
-    // Bind
-    Bind(listenfd, (struct sockaddr *)&r, sizeof(r));
-    // Listen
-    Listen(listenfd, BACKLOG); // 5 is the number of clients that can listen before you accept
-			 // It is not the max number of clients you can have
+    int on = 1;
+    if (useuring ? uring_init() < 0 : reactor_init() < 0)
+	unix_error("setup");
+    // Preallocate this shard's share of the client records
+    slabsize = (capacity + nshards - 1) / nshards;
+    pool_grow(slabsize);
+    if (self->listenfd >= 0) // handed over by the process before, listening already
+	listenfd = self->listenfd;
+    else
+    {
+	// Socket
+	// Non-blocking, so newconnection() can accept until the queue is empty
+	listenfd = Socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0); // will exit if error
+	// Every shard binds its own listener to the port, the kernel spreads connections between them
+	if (setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) < 0 ||
+	    setsockopt(listenfd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) < 0)
+	    unix_error("setsockopt");
+	memset(&r, '\0', sizeof(r));
+	r.sin_family = AF_INET;
+	r.sin_addr.s_addr = INADDR_ANY;
+	r.sin_port = htons(port); // might be PORT instead, depending on define above
+	// Bind
+	Bind(listenfd, (struct sockaddr *)&r, sizeof(r));
+	// Listen
+	Listen(listenfd, backlog); // the number of connections the kernel holds until they are accepted
+			     // It is not the max number of clients you can have
+	self->listenfd = listenfd; // so it can be handed over (-U)
+    }
+    if (useuring)
+    {
+	uring_accept(listenfd, UK_ACCEPT);
+	accepting = 1;
+	uring_poll(self->evfd, UPOLLTAG(self->evfd));
+    }
+    else if (reactor_add(listenfd, RE_READ) < 0 || reactor_add(self->evfd, RE_READ) < 0)
+	exit(1);
 }
 
 //--------------------------------------------------------------------------------------
 
-// This function reads and process one client p to see what commands or messages it has to say
-static void read_process(struct client *p1)
+// This function opens the stats listener on 127.0.0.1 (only reachable from this machine)
+static void statssetup(void)
+{
+    struct sockaddr_in r;
+    int on = 1;
+    if ((statsfd = upstatsfd) < 0) // not handed over
+    {
+	statsfd = Socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (setsockopt(statsfd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) < 0)
+	    unix_error("setsockopt");
+	memset(&r, '\0', sizeof(r));
+	r.sin_family = AF_INET;
+	r.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	r.sin_port = htons(statsport);
+	Bind(statsfd, (struct sockaddr *)&r, sizeof(r));
+	Listen(statsfd, backlog);
+    }
+    if (useuring)
+	uring_poll(statsfd, UPOLLTAG(statsfd));
+    else if (reactor_add(statsfd, RE_READ) < 0)
+	exit(1);
+}
+
+//--------------------------------------------------------------------------------------
+
+// This function accepts a stats connection, writes one snapshot of every shard and closes it
+// The snapshot is one write() to a fresh local socket, which always has room for it
+static void sendstats(void)
 {
-    char msg[MAXNAME + 2 + MAXMSG + 2 + 1]; // the msg to be read
-    char *s = myreadline(p1); // read one line from p1, returns NULl if line is not filled or p1 has been removed
-    // If s is null, return
-    if (!s)
+    static char buf[STATSBUF];
+    struct stats *s[MAXSHARDS];
+    int fd, i;
+    size_t len;
+    if ((fd = accept(statsfd, NULL, NULL)) < 0)
+    {
+	perror("stats accept");
 	return;
+    }
+    for (i = 0; i < nshards; i++)
+	s[i] = shards[i].stats;
+    len = stats_print(buf, sizeof(buf), s, nshards);
+    if (write(fd, buf, len) < 0)
+	perror("stats write");
+    close(fd);
+}
+
+//--------------------------------------------------------------------------------------
+
+// This function reads what p1 sent and processes every complete line in it,
+// so commands sent together (e.g. "y\r\nhi\r\na\r\n") are all handled
+static void read_process(struct client *p1)
+{
+    struct iovec iov[2];
+    ssize_t nbytes;
+    // Read into the free space of p1's ring, one readv() however it is split
+    if (!p1->in)
+	p1->in = ring_get(); // given back once its lines are handled
+    nbytes = Readv(p1->fd, iov, ring_space(p1->in, iov));
+    if (nbytes <= 0)
+    {
+	if (nbytes < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+	{
+	    putring(p1);
+	    return; // spurious wakeup, the socket is non-blocking
+	}
+	// Here, nbytes == 0 or the connection failed (e.g. reset),
+	// either way only this client is affected
+        // A client drops if you get 0 bytes from a 'read' after
+	// 'select' clarifies that there was action on the FD.
+	dropclient(p1);
+	return; // since client does not exist anymore
+    }
+    st.bytesin += nbytes;
+    ring_fill(p1->in, nbytes);
+    if (recpath) // log what was read, from both pieces of the ring if it wrapped
+    {
+	size_t k = iov[0].iov_len < (size_t)nbytes ? iov[0].iov_len : (size_t)nbytes;
+	rec_data(p1->recid, iov[0].iov_base, k);
+	if (k < (size_t)nbytes)
+	    rec_data(p1->recid, iov[1].iov_base, nbytes - k);
+    }
+    process_input(p1);
+}
+
+//--------------------------------------------------------------------------------------
+
+// This function handles every complete line in p1's ring
+// Lines longer than MAXMSG are cut at MAXMSG bytes; once p1 is on its way to another
+// shard, the lines after its name stay in the ring for that shard
+// A ring left empty goes back to the pool, p1 gets one again when it has input
+// It returns 0, or -1 if p1 was removed
+static int process_input(struct client *p1)
+{
+    static __thread char scratch[MAXMSG + 1]; // a line that wraps around the ring is copied here
+    uint64_t t;
+    char *s;
+    if (!p1->in)
+	return 0; // nothing buffered
+    if (linerate) // the credit earned since p1 was last heard from
+	p1->credit = credit(p1->credit, wheel.now > p1->heard ? wheel.now - p1->heard : 0);
+    p1->heard = wheel.now; // not idle
+    for (t = stats_now(); p1->handto < 0 && (s = ring_line(p1->in, scratch, MAXMSG)); t = stats_now())
+    {
+	st.lines++;
+	hist_add(&st.parse, stats_now() - t);
+	// Every line costs SECS(1) credit: one over the rate is framed and dropped, it never
+	// reaches the game, and a client that keeps it up is disconnected
+	if (linerate && (p1->credit -= SECS(1)) < 0)
+	{
+	    st.shed++;
+	    if (p1->credit >= -FLOODLINES * (int)SECS(1))
+		continue;
+	    st.flooded++;
+	    farewell(p1, floodmsg);
+	    dropclient(p1);
+	    return -1;
+	}
+	if (process_line(p1, s) < 0)
+	    return -1; // p1 was removed
+    }
+    putring(p1);
+    return 0;
+}
+
+//--------------------------------------------------------------------------------------
+
+// This function returns credit after ticks more ticks: linerate for every tick, up to
+// BURSTSECS worth of lines (a debt is paid off at the same rate)
+static int credit(int credit, uint64_t ticks)
+{
+    int64_t c = credit + (int64_t)ticks * linerate, most = (int64_t)linerate * BURSTSECS * SECS(1);
+    return c > most ? (int)most : (int)c;
+}
+
+//--------------------------------------------------------------------------------------
+
+// This function gives p's ring back to the pool if everything in it was handled
+static void putring(struct client *p)
+{
+    if (p->in && !ring_used(p->in))
+    {
+	ring_put(p->in);
+	p->in = NULL;
+    }
+}
+
+//--------------------------------------------------------------------------------------
+
+// This function copies n bytes io_uring received for p1 into its ring and handles the lines,
+// a piece at a time if they don't all fit (every complete line is handled, so each piece
+// leaves at least RINGSIZE - MAXMSG bytes free)
+static void deliver(struct client *p1, const char *buf, size_t n)
+{
+    struct iovec iov[2];
+    size_t k;
+    int i, cnt;
+    if (recpath)
+	rec_data(p1->recid, buf, n);
+    while (n > 0)
+    {
+	if (!p1->in)
+	    p1->in = ring_get(); // given back once its lines are handled
+	if (!(cnt = ring_space(p1->in, iov)))
+	    return; // p1 is being handed over with a full ring, the rest is dropped
+	for (i = 0; i < cnt && n > 0; i++)
+	{
+	    k = iov[i].iov_len < n ? iov[i].iov_len : n;
+	    memcpy(iov[i].iov_base, buf, k);
+	    ring_fill(p1->in, k);
+	    buf += k;
+	    n -= k;
+	}
+	if (process_input(p1) < 0)
+	    return; // p1 was removed, the rest is dropped with it
+    }
+}
+
+//--------------------------------------------------------------------------------------
+
+// This function handles one line s from p1
+// It returns 0, or -1 if p1 was removed
+static int process_line(struct client *p1, char *s)
+{
     // If p1 has a name
     if (p1->name[0])
     {
@@ -326,27 +1326,37 @@ static void read_process(struct client *p1)
 	    //=============
 	    else if ((check = strchr(s, 'a')) && (strlen(check) == 1)) // if it is only one a character
 	    {
+		uint64_t t = stats_now();
 		attack(p1, p2);
 		// Update turns
 		p1->turn = 0;
 		p2->turn = 1;
+		timer_cancel(&wheel, &p1->deadline);
+		startclock(p2);
 		// Check winner
-		if(p2 == NULL || p2->hp <= 0)
+		if(p2 == NULL || engine_over(&p2->ft))
 		    endgame(p1, p2);
+		st.turns++;
+		hist_add(&st.turn, stats_now() - t);
 	    }
             //=============
             // PowerUp!
             //=============
 	    else if ((check = strchr(s, 'p')) && (strlen(check) == 1)) // if it is only one p character
 	    {
+		uint64_t t = stats_now();
 		if(powerup(p1, p2)) // returns 0 if no pu's left, 1 if successful
 		{
 		    // Update turns
 		    p1->turn = 0;
 		    p2->turn = 1;
+		    timer_cancel(&wheel, &p1->deadline);
+		    startclock(p2);
 		    // Check winner
-                    if(p2 == NULL || p2->hp <= 0)
+                    if(p2 == NULL || engine_over(&p2->ft))
                 	endgame(p1, p2);
+		    st.turns++;
+		    hist_add(&st.turn, stats_now() - t);
 		}
 		// else, do nothing
 	    }
@@ -357,16 +1367,23 @@ static void read_process(struct client *p1)
 	    {
 		if (p1->yell) // if p1 can yell
 		{
-		    char yellmsg[MAXBUF];
-		    sprintf(yellmsg, yelled, p1->name, s);
-		    Writen(p1->nowfd, yellmsg, strlen(yellmsg));
+		    struct targ a[2] = { TSTR(p1->name, p1->namelen), TSTR(s, strlen(s)) };
+		    queuetmpl(p2, NULL, &tyelled, a);
+		    if (watched(p1, p2))
+		    {
+			struct frame *f = frame_get();
+			frame_add(f, &tyelled, a);
+			watchcast(p1, p2, f);
+			frame_put(f);
+		    }
 		    p1->yell = 0; // reset yell
 		}
-		cleanup(p1); // if p1 can't yell, cleanup p1.
 	    }
 	}
-	// If it's not p1's turn, cleanup p1
-	cleanup(p1);
+	// A player who isn't playing may watch someone who is
+	else if (p1->nowfd == -5 && !strncmp(s, "watch ", 6))
+	    watch(p1, s + 6);
+	// If it's not p1's turn, the line is discarded
     }
     //=============
     // New Player!
@@ -378,10 +1395,28 @@ static void read_process(struct client *p1)
 	strncpy(p1->name, s, MAXNAME); // copy s into p's name
 	p1->name[MAXNAME] = '\0'; // null terminate it's name
 	if (p1->name[0]) // if now p has a name
-	{   // broadcast the message to everyone
-	    sprintf(msg, "Player %s has entered the arena. \r\n", p1->name);
-	    broadcast(msg, strlen(msg));
-	    Writen(p1->fd, waitmsg, strlen(waitmsg));
+	{
+	    timer_cancel(&wheel, &p1->deadline); // named in time
+	    p1->namelen = strlen(p1->name);
+	    queuestr(p1, waitmsg);
+	    if ((p1->resume = snap_claim(p1->name))) // back after a crash, to the same room
+	    {
+		p1->rating = p1->resume->rating;
+		p1->room = p1->resume->room;
+		room_take(p1->room);
+	    }
+	    else
+		p1->room = room_join();
+	    if (p1->room % nshards == self->id)
+	    {
+		joinroom(p1); // tell everyone in the room
+		ready_join(p1); // start a match if someone is waiting
+	    }
+	    else // the room's shard does both when p1 gets there
+	    {
+		p1->handto = p1->room % nshards;
+		clist_append(&handq, p1);
+	    }
 	}
 	// Error: Unknown protocol, remove player
 	else
@@ -390,176 +1425,228 @@ static void read_process(struct client *p1)
 	    static char botchmsg[] = "Protocol error! \r\n";
 	    write(p1->fd, botchmsg, strlen(botchmsg));
 	    fflush(stdout);
-	    close(p1->fd);
-	    removeclient(p1);
+	    removeclient(p1); // closes p1->fd
+	    return -1;
 	}
     }
+    return 0;
 }
 
+
 //--------------------------------------------------------------------------------------
 
-// This function returns the first pointer to the next occurence of /r/n, \r, or \n
-// and NULL if it is not found within the limit
-char* extractline(char *s, int limit)
+// This function accepts the connections waiting on listenfd and updates the linked list
+// At most acceptbudget are taken, so a reconnect storm can't hold up the game;
+// the listener stays readable and the rest are taken in the next loop iterations
+// It returns the number of connections accepted
+static int newconnection(void)
 {
-    int crlf; // position of next '\r' or '\n' or "\r\n"
-    char *tok;
-    // Clean up if no room left
-    tok = strtok (s, "\r\n"); // if it exists, will return pointer to the next string (null terminated) that exists
-    if (tok)
+    int newfd, n = 0;
+    while (n < acceptbudget)
     {
-	crlf = strlen(tok); // get position of the newline character
-	tok += crlf;
-	return tok; // return pointer to the end of the string
+	// Never block on a client, a slow reader's output waits in its queue instead
+	// (accept4() makes the socket non-blocking and close-on-exec in the same call)
+	if ((newfd = accept4(listenfd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) < 0)
+	{
+	    if (errno == EINTR || errno == ECONNABORTED)
+		continue; // that one gave up before we got to it
+	    if (errno != EAGAIN && errno != EWOULDBLOCK)
+		perror("accept4"); // e.g. out of fds, the connection waits in the backlog
+	    break;
+	}
+	newclient(newfd);
+	n++;
     }
-    tok = strtok (s, "\r");
-    if (tok)
+    return n;
+}
+
+// This function adds the client on the accepted (non-blocking) fd and asks for its name
+static void newclient(int fd)
+{
+    struct client *p;
+    st.accepts++;
+    // Past the cap the connection is told so and closed before anything is allocated for it
+    // (a place is taken first, so shards accepting at once can't pass the cap together)
+    if (atomic_fetch_add_explicit(&nconns, 1, memory_order_relaxed) >= maxconns)
     {
-	crlf = strlen(tok); // get position of the newline character
-	tok += crlf;
-	return tok; // return pointer to the end of the string
+	atomic_fetch_sub_explicit(&nconns, 1, memory_order_relaxed);
+	st.rejected++;
+	write(fd, fullmsg, sizeof(fullmsg) - 1); // one try, it is closed either way
+	close(fd);
+	return;
     }
-    tok = strtok (s, "\n");
-    if (tok)
+    if (!(p = addclient(fd))) // add the new client into the linked list
+	atomic_fetch_sub_explicit(&nconns, 1, memory_order_relaxed); // closed
+    else
     {
-	crlf = strlen(tok); // get position of the newline character
-	tok += crlf;
-	return tok; // return pointer to the end of the string
+	queuestr(p, greeting); // ask for name
+	if (namesecs)
+	    timer_arm(&wheel, &p->deadline, SECS(namesecs));
     }
-    // if none found
-    return NULL;
+    // will include name & announce in read_process()
 }
 
-// This function reads a line from a client's buffer
-// and returns a char pointer to the first character of the line
-// or NULL if the line is not fully filled
-char *myreadline(struct client *p)
+//--------------------------------------------------------------------------------------
+
+// This function announces s to everyone in room
+// It is added to the room's batch, sent to the members by flushrooms() before the flush;
+// if another shard hosts the room, it gets a copy on its inbox
+static void roomcast(int room, const char *s, int size)
 {
-    int nbytes = 0; // number of bytes
-    // Read from fd to client's buffer
-    nbytes = Readn(p->fd, p->buf, p->bytesleft); // NOT SURE IF IT READS AT BEGINNING OF BUF OR THE PROPER POSITION IN IT
-    if (nbytes <= 0) // if nothing to read, remove client
+    struct room *r;
+    struct xmsg *m;
+    if (room % nshards != self->id)
     {
-	if (nbytes < 0)
-	    unix_error("Readn in myreadline");
-	// Here, nbytes == 0
-        // A client drops if you get 0 bytes from a 'read' after
-	// 'select' clarifies that there was action on the FD.
-	if (p->name[0]) // if p has a name, broadcast that he is leaving
-	{
-	    // If p is currently in a game,
-	    if(p->nowfd != -5)
-	    {
-		// End the game
-		struct client *opponent = getclient(p->nowfd);
-		endgame(opponent, p); // p is the loser, p's opponent is the winner
-	    }
-	    char msg[MAXSTR];
-	    sprintf(msg, "Player %s has left the arena\r\n", p->name);
-	    removeclient(p);
-	    broadcast(msg, strlen(msg));
-	}
-	else // just remove p
+	if (!(m = malloc(sizeof(struct xmsg))))
 	{
-	    removeclient(p);
+	    fprintf(stderr, "out of memory!\n");
+	    exit(1);
 	}
-	return NULL; // since client does not exist anymore
+	m->kind = XTEXT;
+	m->room = room;
+	m->len = size < MAXSTR ? size : MAXSTR;
+	memcpy(m->text, s, m->len);
+	post(room % nshards, m);
+	return;
     }
-    else // if there are bytes to read
+    r = getroom(room);
+    if (r->annlen + size > ANNBUF)
     {
-	// Update nextpos
-	if(p->nextpos) // if not NULL
-	    p->nextpos += nbytes;
-	else
-	    p->nextpos = p->buf + nbytes; // Initialize p->nextpos
-	// Update bytesleft
-	p->bytesleft -= nbytes;
-	//===============
-	// Check maxsize
-	//===============
-	// If reached maximum message size,
-	// it becomes a line by default
-	if (((MAXBUF - p->bytesleft) >= MAXMSG)) // if exceed maxmsg size, assume it to be a line
-	{
-					printf("Exceed maxsize in myreadline, making default line\n");
-	    p->buf[p->bytesleft] = '\0'; // null terminate the line
-	    p->bytesleft = MAXBUF; // initialize bytesleft to MAXBUF
-	    p->nextpos++;
-	    p->nextpos = NULL; // initialize nextpos to be NULL
-	    return(p->buf); // return the default line made
-	}
-	// If did not exceed maxsize,
-	// Check for newline character
-	if ((p->nextpos = extractline(p->buf, MAXMSG))) // extractline returns pointer to next \r\n, \r, or \n character
-	{   // extract line returns NULL if the /r/n is not found and it's position otherwise
-	    // Update bytesleft
-	    p->bytesleft = MAXBUF; // reset bytesleft
-	    p->nextpos = '\0'; // null terminate the string
-	    p->nextpos++;
-	    p->nextpos = NULL;
-	    return(p->buf); // Returns the pointer to the string read
-	}
-	// If no newline character detected, nextpos = NULL;
-	// Here, there is no full input line.
-	// nextpost, buf & nbytes is updated too!
+	// The batch is full, send it now (the announcements stay in order)
+	struct client *p;
+	for (p = r->members.head; p; p = p->mlink.next)
+	    queuemsg(p, r->ann, r->annlen); // write errors are handled when the queue is flushed
+	r->annlen = 0;
     }
-    return NULL;
+    if (!r->pending) // the first announcement this iteration
+    {
+	r->pending = 1;
+	r->annnext = annhead;
+	annhead = room;
+    }
+    memcpy(r->ann + r->annlen, s, size);
+    r->annlen += size;
 }
 
-//--------------------------------------------------------------------------------------
-
-// This function clears the client's buffer, then removes useless messages on a client's fd if it exists,
-// and removes the client if it does not.
-void cleanup(struct client *p)
+// This function returns the state of room id, which this shard hosts
+static struct room *getroom(int id)
 {
-    //============================
-    // Clear the buffer (p->buf)
-    //============================
-    // clear the previous bytes
-    if(p->nextpos) // if not NULL
-	memmove(p->buf, p->nextpos, p->bytesleft); // copies bytes left from nextpost to beginning of buf
-    // reset values
-    p->nextpos = NULL;
-    p->bytesleft = MAXBUF;
-    return;
+    int i = id / nshards, b;
+    if (i >= roomcap)
+    {
+	int newcap = roomcap ? roomcap : 16;
+	while (newcap <= i)
+	    newcap *= 2; // double until i fits
+	struct room *t = realloc(rooms, newcap * sizeof(*t));
+	if (!t)
+	{
+	    fprintf(stderr, "out of memory!\n");
+	    exit(1);
+	}
+	for (; roomcap < newcap; roomcap++) // new rooms are empty
+	{
+	    struct room *r = &t[roomcap];
+	    r->members = (struct clist){ NULL, NULL, offsetof(struct client, mlink), 0 };
+	    for (b = 0; b < NBUCKETS; b++)
+		r->ready[b] = (struct clist){ NULL, NULL, offsetof(struct client, rlink), 0 };
+	    memset(&r->ladder, 0, sizeof(r->ladder));
+	    r->annlen = 0;
+	    r->pending = 0;
+	    r->annnext = -1;
+	}
+	rooms = t;
+    }
+    return &rooms[i];
 }
 
-//--------------------------------------------------------------------------------------
+// This function adds p to its room's members, on the shard that hosts the room,
+// and tells the room (p included) that p has entered
+static void joinroom(struct client *p)
+{
+    char msg[MAXBUF];
+    struct targ a[1] = { TSTR(p->name, p->namelen) };
+    clist_append(&getroom(p->room)->members, p);
+    p->inroom = 1;
+    roomcast(p->room, msg, tmpl_render(&tentered, msg, a));
+}
 
-// This function accepts new connections and updates the linked list
-void newconnection()
+// This function queues each room's batch of announcements for its members, one message each
+static void flushrooms(void)
 {
-    int newfd;
-    struct sockaddr_in r;
-    socklen_t len = sizeof(r);
-    if((newfd = Accept(listenfd, (struct sockaddr *)&r, &len)) < 0); // error if -1,
-    addclient(newfd); // add the new client into the linked list
-    Writen(newfd, greeting, strlen(greeting)); // ask for name
-    // will include name & broadcast in read_process()
-    return;
+    struct room *r;
+    struct client *p;
+    int id;
+    while ((id = annhead) != -1)
+    {
+	r = getroom(id);
+	annhead = r->annnext;
+	r->pending = 0;
+	for (p = r->members.head; p; p = p->mlink.next)
+	    queuemsg(p, r->ann, r->annlen); // write errors are handled when the queue is flushed
+	r->annlen = 0;
+    }
 }
 
 //--------------------------------------------------------------------------------------
 
-// This function broadcasts a message to everyone in the server
-static void broadcast(char *s, int size)
+// This function handles a client that dropped (or can't be written to):
+// its opponent wins, everyone is told it left, and it is removed
+static void dropclient(struct client *p)
 {
-    // Make 2 pointers to move through the linked list
-    struct client *p, *nextp;
-    for (p = top; p; p = nextp) // will eventually end at end of linked list where nextp is NULL
+    if (p->name[0]) // if p has a name, tell the room that he is leaving
     {
-	nextp = p->next;  // In case the client is removed due to error
-	if (p->name[0]) // if p has a name
+	// If p is currently in a game,
+	if(p->nowfd != -5)
 	{
-	    if (write(p->fd, s, size) != size)
+	    // End the game, p's spectators see the winner's side of it
+	    struct client *opponent = getclient(p->nowfd), *w;
+	    while ((w = p->watchers.head))
 	    {
-		perror("write()");
-		removeclient(p);
+		clist_remove(&p->watchers, w);
+		clist_append(&opponent->watchers, w);
+		w->watching = opponent;
 	    }
+	    endgame(opponent, NULL); // p is the loser (by leaving), p's opponent is the winner
 	}
+	char msg[MAXBUF];
+	struct targ a[1] = { TSTR(p->name, p->namelen) };
+	size_t n = tmpl_render(&tleft, msg, a);
+	int room = p->room, inroom = p->inroom;
+	removeclient(p);
+	if (inroom) // the room never heard of p otherwise
+	    roomcast(room, msg, n);
+    }
+    else // just remove p
+    {
+	removeclient(p);
     }
 }
 
+// This function prints the command line options and exits
+static void usage(char *prog)
+{
+    fprintf(stderr, "usage: %s [-a budget] [-b backlog] [-c capacity] [-C maxconns] [-i idlesecs] [-k file [-K secs] [--restore]] [-L lines] [-m movesecs] [-n namesecs] [-r roomsize] [-R file] [-S seed] [-s statsport] [-t threads] [-u] [-U path] [-w hiwat]\n", prog);
+    fprintf(stderr, "  -a budget  most connections accepted per loop iteration (default %d)\n", ACCEPTBUDGET);
+    fprintf(stderr, "  -b backlog  connections the kernel queues until they are accepted (default %d)\n", BACKLOG);
+    fprintf(stderr, "  -c capacity  client records to preallocate, split between threads (default %d)\n", CAPACITY);
+    fprintf(stderr, "  -C maxconns  close connections on arrival past this many (default the descriptor limit less %d)\n", FDSPARE);
+    fprintf(stderr, "  -i idlesecs  disconnect clients that send nothing for this long, 0 never (default %d)\n", IDLESECS);
+    fprintf(stderr, "  -k file  write a snapshot of the players and their matches to file every -K secs (default %d)\n", SNAPSECS);
+    fprintf(stderr, "  --restore  load the -k snapshot at startup, players who reconnect get their rating and battle back\n");
+    fprintf(stderr, "  -L lines  lines per second a client may send, the rest are dropped, 0 no limit (default %d)\n", LINERATE);
+    fprintf(stderr, "  -m movesecs  a player who doesn't play a turn in time forfeits, 0 never (default %d)\n", MOVESECS);
+    fprintf(stderr, "  -n namesecs  disconnect clients that don't enter a name in time, 0 never (default %d)\n", NAMESECS);
+    fprintf(stderr, "  -r roomsize  players per room; players only meet and hear about their room (default %d)\n", ROOMSIZE);
+    fprintf(stderr, "  -R file  record every connection's inbound bytes, with timestamps, for replay\n");
+    fprintf(stderr, "  -S seed  seed for the damage rolls, each match rolls from seed and its id (default 1)\n");
+    fprintf(stderr, "  -s statsport  serve a plain-text stats snapshot on 127.0.0.1:statsport (default off)\n");
+    fprintf(stderr, "  -t threads  number of shard threads, each with its own listener (default 1, at most %d)\n", MAXSHARDS);
+    fprintf(stderr, "  -u  use io_uring instead of epoll, if the kernel has it (Linux 6.0 or later)\n");
+    fprintf(stderr, "  -U path  take over from the server on this UNIX socket, if one runs, and let the next take over\n");
+    fprintf(stderr, "  -w hiwat  disconnect clients with more than hiwat bytes of unsent output (default %d)\n", HIWAT);
+    exit(1);
+}
+
 // This function executes a unix-style error routine.
 void unix_error(char *msg)
 {
@@ -571,107 +1658,1146 @@ void unix_error(char *msg)
 // Client Functions
 //============================================
 
-// This function adds a client with the given fd
-static void addclient(int fd)
+// This function returns the links p uses for list l
+static struct clink *clink(struct clist *l, struct client *p)
 {
-    // Make a new client node
-    struct client *p = malloc(sizeof(struct client));
-    if (!p) // if errors with malloc
-    {
-	fprintf(stderr, "out of memory!\n");
-	exit(1);
+    return (struct clink *)((char *)p + l->off);
+}
+
+// This function adds p to the tail of list l
+static void clist_append(struct clist *l, struct client *p)
+{
+    struct clink *lk = clink(l, p);
+    lk->prev = l->tail;
+    lk->next = NULL;
+    if (l->tail) // list was not empty
+	clink(l, l->tail)->next = p;
+    else
+	l->head = p;
+    l->tail = p;
+    l->n++;
+}
+
+// This function unlinks p from list l (p must be on l)
+static void clist_remove(struct clist *l, struct client *p)
+{
+    struct clink *lk = clink(l, p);
+    if (lk->prev)
+	clink(l, lk->prev)->next = lk->next;
+    else
+	l->head = lk->next;
+    if (lk->next)
+	clink(l, lk->next)->prev = lk->prev;
+    else
+	l->tail = lk->prev;
+    lk->prev = lk->next = NULL;
+    l->n--;
+}
+
+//--------------------------------------------------------------------------------------
+
+// This function adds a client with the given fd
+// It returns the new client, or NULL if fd could not be watched
+static struct client *addclient(int fd)
+{
+    // Make a new client node
+    struct client *p = pool_get();
+    p->fd = fd;
+    p->in = NULL; // nothing read yet
+    if (recpath)
+	p->recid = rec_conn();
+    p->name[0] = '\0'; // Null terminate the name
+    // Combat variables
+    p->ready = 1; // new client is ready to play
+    p->turn = 0; // not this client's turn
+    p->nowfd = -5; // -5 => not playing, other number => currently playing
+    p->lastfd = -5; //
+		    // ( negative number since fd will never be negative)
+    p->ft.hp = 0; // hit point
+    p->ft.pu = 0; // powerups
+    p->yell = 0; // can't yell until 'y'
+    p->ohead = p->otail = NULL; // nothing to write
+    p->inflight = p->sending = p->recving = p->leaving = p->closing = 0;
+    p->sendtail = NULL;
+    p->opending = 0;
+    p->overflow = 0;
+    p->room = -1; // not in a room until named
+    p->inroom = 0;
+    p->rating = RATING0;
+    p->resume = NULL; // nothing to come back to
+    timer_init(&p->retry, retry_fired);
+    p->watching = NULL; // not a spectator
+    p->watchers = (struct clist){ NULL, NULL, offsetof(struct client, wlink), 0 };
+    p->skips = 0;
+    timer_init(&p->deadline, deadline_fired);
+    timer_init(&p->idle, idle_fired);
+    p->heard = wheel.now;
+    p->credit = credit(0, BURSTSECS * SECS(1)); // a full bucket
+    // Watch fd and add it to this shard
+    if (attach(p) < 0)
+    {
+	close(fd);
+	pool_put(p);
+	return NULL;
+    }
+    return p;
+}
+
+//--------------------------------------------------------------------------------------
+
+// This function adds p (new, or handed over by another shard) to this shard:
+// it is indexed by fd, put at the end of the client list and watched by the reactor
+// It returns 0 on success, -1 if fd could not be watched
+static int attach(struct client *p)
+{
+    int fd = p->fd;
+    // Grow the fd table if fd does not fit
+    if (fd >= fdcap)
+    {
+	int newcap = fdcap ? fdcap : 64;
+	while (newcap <= fd)
+	    newcap *= 2; // double until fd fits
+	struct client **t = realloc(fdtab, newcap * sizeof(*t));
+	if (!t)
+	{
+	    fprintf(stderr, "out of memory!\n");
+	    exit(1);
+	}
+	memset(t + fdcap, 0, (newcap - fdcap) * sizeof(*t)); // new slots are empty
+	fdtab = t;
+	fdcap = newcap;
+    }
+    // Watch fd for input, and for output if some is still queued
+    if (useuring)
+    {
+	uring_recv(fd, UTAG(p, UK_RECV)); // takes input until cancelled
+	p->inflight++;
+	p->recving = 1;
+	p->leaving = 0;
+    }
+    else if (reactor_add(fd, RE_READ | (p->ohead ? RE_WRITE : 0)) < 0)
+	return -1;
+    p->wantwrite = p->ohead != NULL; // only watched for RE_WRITE while output is pending
+    p->queued = 0; // joins the ready queue once named
+    p->dirty = 0;
+    p->handto = -1;
+    // Time since p was last heard from on another shard counts too
+    // (idle_fired() checks again when it fires, so an overdue check just fires next tick)
+    if (idlesecs)
+	timer_arm(&wheel, &p->idle, p->heard + SECS(idlesecs) > wheel.now ?
+		p->heard + SECS(idlesecs) - wheel.now : 1);
+    // Add to the end of the client list and index it by fd
+    clist_append(&clients, p);
+    fdtab[fd] = p;
+    if (useuring && p->ohead) // output queued on the last shard goes out from here
+    {
+	clist_append(&flushq, p);
+	p->dirty = 1;
+    }
+    return 0;
+}
+
+//--------------------------------------------------------------------------------------
+
+// This function takes p off every list of this shard and stops watching its fd,
+// but leaves the fd open and the client allocated so another shard can attach() it
+static void detach(struct client *p)
+{
+    fdtab[p->fd] = NULL; // fd is free for the next client
+    clist_remove(&clients, p);
+    if (p->queued)
+	dequeue(p);
+    if (p->inroom)
+	clist_remove(&getroom(p->room)->members, p);
+    if (p->watching)
+	unwatch(p);
+    if (p->dirty)
+	clist_remove(&flushq, p);
+    if (p->handto >= 0)
+	clist_remove(&handq, p);
+    if (p->resume && p->inroom && slots[snap_index(p->resume)].held == p)
+	slots[snap_index(p->resume)].held = NULL; // its opponent waits for it again
+    p->queued = p->dirty = p->inroom = 0;
+    p->handto = -1;
+    timer_cancel(&wheel, &p->deadline); // the wheel is this shard's
+    timer_cancel(&wheel, &p->idle);
+    if (!useuring)
+	reactor_del(p->fd); // stop watching the file descriptor
+}
+
+//--------------------------------------------------------------------------------------
+
+// This function removes a client
+static void removeclient(struct client *p)
+{
+    if (getclient(p->fd) != p)
+    {
+	// Error
+	fprintf(stderr, "Trying to remove fd %d, it isn't in the list\n", p->fd);
+	fflush(stderr);
+	return;
+    }
+    detach(p);
+    freeclient(p);
+}
+
+//--------------------------------------------------------------------------------------
+
+// This function closes a detached client's fd and frees it
+// With io_uring, operations still in flight are cancelled first, and the last
+// of them to complete calls this again (the kernel may still be sending p's segments)
+static void freeclient(struct client *p)
+{
+    if (p->inflight)
+    {
+	if (!p->closing)
+	    uring_cancel(p->fd);
+	p->closing = 1;
+	return;
+    }
+    while (p->ohead) // unsent output is discarded
+    {
+	struct outseg *seg = p->ohead;
+	p->ohead = seg->next;
+	segput(seg);
+    }
+    close(p->fd); // close the file descriptor
+    st.closes++;
+    atomic_fetch_sub_explicit(&nconns, 1, memory_order_relaxed);
+    if (recpath)
+	rec_close(p->recid);
+    if (p->in)
+	ring_put(p->in);
+    if (p->room >= 0)
+	room_leave(p->room); // its place can be given to someone else
+    if (p->resume)
+	snap_release(p->resume); // it can come back as that record again
+    pool_put(p);
+}
+
+//--------------------------------------------------------------------------------------
+
+// This function allocates a slab of n contiguous client records and frees them all
+// Slabs are never returned, so a record handed to another shard can be freed there
+static void pool_grow(int n)
+{
+    struct client *slab = calloc(n, sizeof(struct client));
+    int i;
+    if (!slab)
+    {
+	fprintf(stderr, "out of memory!\n");
+	exit(1);
+    }
+    for (i = n - 1; i >= 0; i--) // so the first record is handed out first
+	pool_put(&slab[i]);
+}
+
+// This function takes a client record off the free list in O(1)
+// If the preallocated records are used up, another slab of the same size is added
+static struct client *pool_get(void)
+{
+    struct client *p;
+    if (!clfree)
+	pool_grow(slabsize);
+    p = clfree;
+    clfree = p->link.next;
+    return p;
+}
+
+// This function puts a client record back on the free list in O(1)
+static void pool_put(struct client *p)
+{
+    p->link.next = clfree;
+    clfree = p;
+}
+
+//--------------------------------------------------------------------------------------
+
+// This function returns a client based on the fd given
+struct client *getclient(int fd)
+{
+    if (fd < 0 || fd >= fdcap)
+	return NULL; // client not found (e.g. nowfd == -5)
+    return fdtab[fd];
+}
+
+//--------------------------------------------------------------------------------------
+
+// This function moves the current client to the end of the linked list
+// and matches it or puts it back on the ready queue
+static void requeue(struct client *p)
+{
+    clist_remove(&clients, p);
+    clist_append(&clients, p);
+    ready_join(p);
+}
+
+//--------------------------------------------------------------------------------------
+
+// This function pairs p with the longest waiting client it can play,
+// or appends p to the ready queue if there is none
+// At most one waiting client (the one p just played) can refuse p, so this is O(1)
+static void ready_join(struct client *p)
+{
+    struct client *q;
+    if (p->queued)
+	return; // already waiting
+    if (p->resume && rejoin(p))
+	return; // its match from the snapshot carries on
+    if ((q = nearest(p)))
+    {
+	dequeue(q);
+	initialize_match(q, p); // q waited longer, so q attacks first
+	return;
+    }
+    p->since = wheel.now;
+    enqueue(p);
+}
+
+//--------------------------------------------------------------------------------------
+
+// This function returns the waiting client p can play whose rating is closest to p's,
+// within p's window (the longest waiting one of the nearest bucket), or NULL if none is
+// The occupied buckets either side are found from the room's ladder, so empty stretches
+// of ratings cost nothing; in a bucket, at most one client (the one p just played) refuses p
+static struct client *nearest(struct client *p)
+{
+    struct room *r = getroom(p->room);
+    struct client *q;
+    int win = MATCHWIN, b = rating_bucket(p->rating), lo, hi, next;
+    if (p->queued) // its window has been widening
+	win += WIDENPTS * (int)((wheel.now - p->since) / SECS(1));
+    lo = ladder_below(&r->ladder, b + 1); // the nearest occupied bucket at or below b
+    hi = ladder_above(&r->ladder, b); // and above it
+    // Walk out from b, taking whichever side is closer next
+    while (lo >= 0 || hi >= 0)
+    {
+	if (hi < 0 || (lo >= 0 && b - lo <= hi - b))
+	{
+	    next = lo;
+	    lo = ladder_below(&r->ladder, lo);
+	}
+	else
+	{
+	    next = hi;
+	    hi = ladder_above(&r->ladder, hi);
+	}
+	if (abs(next - b) * BUCKETW > win + BUCKETW)
+	    break; // the rest are further away still
+	for (q = r->ready[next].head; q; q = q->rlink.next)
+	{
+	    if (q != p && abs(q->rating - p->rating) <= win && matchup(q, p))
+		return q;
+	}
+    }
+    return NULL;
+}
+
+//--------------------------------------------------------------------------------------
+
+// This function puts p at the end of its rating bucket and starts its retry clock
+static void enqueue(struct client *p)
+{
+    struct room *r = getroom(p->room);
+    p->bucket = rating_bucket(p->rating);
+    clist_append(&r->ready[p->bucket], p);
+    ladder_set(&r->ladder, p->bucket);
+    p->queued = 1;
+    nwaiting++;
+    timer_arm(&wheel, &p->retry, SECS(RETRYSECS));
+}
+
+// This function takes p out of its rating bucket
+static void dequeue(struct client *p)
+{
+    struct room *r = getroom(p->room);
+    clist_remove(&r->ready[p->bucket], p);
+    if (!r->ready[p->bucket].n)
+	ladder_clear(&r->ladder, p->bucket);
+    p->queued = 0;
+    nwaiting--;
+    timer_cancel(&wheel, &p->retry);
+}
+
+//============================================
+// Shard Functions
+//============================================
+
+// This function pushes m on shard to's inbox, waking it if the inbox was empty
+static void post(int to, struct xmsg *m)
+{
+    uint64_t one = 1;
+    if (mpsc_push(&shards[to].inbox, &m->node))
+    {
+	if (write(shards[to].evfd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+	    perror("eventfd write");
+    }
+}
+
+//--------------------------------------------------------------------------------------
+
+// This function sends every client on handq to the shard hosting its room
+static void handoff(void)
+{
+    struct client *p, *next;
+    struct xmsg *m;
+    for (p = handq.head; p; p = next)
+    {
+	next = p->hlink.next;
+	// With io_uring, p waits on handq until its operations are done
+	if (useuring && !quiesce(p))
+	    continue;
+	if (!(m = malloc(sizeof(struct xmsg))))
+	{
+	    fprintf(stderr, "out of memory!\n");
+	    exit(1);
+	}
+	m->kind = XCLIENT;
+	m->p1 = p;
+	m->node.next = NULL;
+	int to = p->handto;
+	detach(p);
+	st.handedout++;
+	post(to, m);
+    }
+}
+
+//--------------------------------------------------------------------------------------
+
+// This function handles everything other shards pushed on this shard's inbox
+static void receive(void)
+{
+    uint64_t n;
+    struct mpsc_node *node, *next;
+    struct xmsg *m;
+    if (read(self->evfd, &n, sizeof(n)) < 0 && errno != EAGAIN) // reset the wakeup
+	perror("eventfd read");
+    for (node = mpsc_popall(&self->inbox); node; node = next)
+    {
+	next = node->next;
+	m = (struct xmsg *)node;
+	switch (m->kind)
+	{
+	case XCLIENT: // a player named on another shard, for a room here
+	    st.handedin++;
+	    if (attach(m->p1) < 0)
+		freeclient(m->p1); // epoll_ctl() already complained
+	    else
+	    {
+		joinroom(m->p1); // tell everyone in the room
+		ready_join(m->p1);
+		process_input(m->p1); // what it sent after its name
+	    }
+	    break;
+	case XTEXT: // an announcement from another shard, for a room here
+	    roomcast(m->room, m->text, m->len);
+	    break;
+	case XUPGRADE: // stop at the end of this loop iteration
+	    freezing = 1;
+	    break;
+	case XSNAP: // likewise, for a snapshot
+	    snapping = 1;
+	    break;
+	}
+	free(m);
+    }
+}
+
+//============================================
+// Upgrade Functions
+//============================================
+
+// This function takes over from the server listening on uppath, if there is one:
+// its listeners (which set nshards), its stats listener and its clients' sockets, with
+// the snapshot each shard restores its clients from as it starts
+// It returns 0 (also when nobody was listening), or -1 if nothing could be taken over
+// (the old server then carries on)
+static int takeover(void)
+{
+    struct upclient u;
+    const char *at, *end;
+    uint32_t k;
+    int s, i, fdi, maxfd = -1;
+    if ((s = upgrade_connect(uppath)) < 0)
+	return 0; // nothing runs there, a fresh start
+    if (upgrade_recv(s, &upin) < 0)
+    {
+	perror("upgrade");
+	close(s);
+	return -1;
+    }
+    if (upin.len < sizeof(uph))
+	goto bad;
+    memcpy(&uph, upin.data, sizeof(uph));
+    if (uph.magic != UPMAGIC || uph.version != UPVERSION || uph.nlisten < 1 ||
+	uph.nlisten > MAXSHARDS || uph.nstats > 1 ||
+	(uint64_t)uph.nlisten + uph.nstats + uph.nclients != (uint64_t)upin.nfds)
+	goto bad;
+    // Check that every record is whole, and see how high the fds there went
+    end = upin.data + upin.len;
+    for (k = 0, at = upin.data + sizeof(uph); k < uph.nclients; k++)
+    {
+	if (!(at = uprecord(at, end, &u)))
+	    goto bad;
+	if (u.fd > maxfd)
+	    maxfd = u.fd;
+    }
+    // Index the sockets by their fd there, and give the named players their places back
+    upmapn = maxfd + 1;
+    if (!(upmap = malloc((upmapn ? upmapn : 1) * sizeof(*upmap))))
+    {
+	fprintf(stderr, "out of memory!\n");
+	exit(1);
+    }
+    memset(upmap, 0xff, upmapn * sizeof(*upmap)); // all -1
+    fdi = uph.nlisten + uph.nstats;
+    for (k = 0, at = upin.data + sizeof(uph); k < uph.nclients; k++)
+    {
+	at = uprecord(at, end, &u);
+	upmap[u.fd] = upin.fds[fdi + k];
+	if (u.room >= 0)
+	    room_take(u.room);
+    }
+    if (nshards != (int)uph.nlisten)
+	fprintf(stderr, "upgrade: running %u threads like the server before\n", uph.nlisten);
+    nshards = uph.nlisten;
+    for (i = 0; i < nshards; i++)
+	shards[i].listenfd = upin.fds[i];
+    if (uph.nstats && statsport)
+	upstatsfd = upin.fds[nshards];
+    else if (uph.nstats)
+	close(upin.fds[nshards]); // nobody asks this one for stats
+    matchbase = uph.nextmatch;
+    if (upgrade_ack(s) < 0) // the old server gave up waiting
+    {
+	perror("upgrade");
+	exit(1);
+    }
+    close(s);
+    fprintf(stderr, "upgrade: took over %u clients\n", uph.nclients);
+    return 0;
+bad:
+    fprintf(stderr, "upgrade: the snapshot doesn't match this build\n");
+    for (i = 0; i < upin.nfds; i++)
+	close(upin.fds[i]);
+    upbuf_free(&upin);
+    close(s);
+    return -1;
+}
+
+//--------------------------------------------------------------------------------------
+
+// This function reads the record at at into u and checks that what follows it ends by end
+// It returns the next record, or NULL if this one doesn't fit
+static const char *uprecord(const char *at, const char *end, struct upclient *u)
+{
+    if ((size_t)(end - at) < sizeof(*u))
+	return NULL;
+    memcpy(u, at, sizeof(*u));
+    if (u->fd < 0 || u->room < -1 || u->namelen > MAXNAME || u->inlen > RINGSIZE ||
+	(size_t)(end - at) - sizeof(*u) < (size_t)u->namelen + u->inlen + u->outlen)
+	return NULL;
+    return at + sizeof(*u) + u->namelen + u->inlen + u->outlen;
+}
+
+// This function returns the shard that takes record k: the one hosting its room,
+// so opponents and spectators stay together, and any one before it is named
+static int upowner(const struct upclient *u, uint32_t k)
+{
+    return u->room >= 0 ? u->room % nshards : (int)(k % nshards);
+}
+
+// This function returns the fd here of the socket that was fd in the process before
+static int upfdof(int fd)
+{
+    return fd >= 0 && fd < upmapn ? upmap[fd] : -1;
+}
+
+//--------------------------------------------------------------------------------------
+
+// This function gives this shard its clients from the snapshot, in three passes:
+// each gets its record back, then its opponent and its room (found through the old fds),
+// then what it watches and its place on the ready queue, and the lines it had sent
+// are handled. A client whose socket can't be watched here is lost, with its match.
+static void restore(void)
+{
+    const char *at, *end = upin.data + upin.len, *name, *in;
+    struct upclient u;
+    struct client *p, *q;
+    struct iovec iov[2];
+    int pass, fdi = uph.nlisten + uph.nstats, cnt, i;
+    uint32_t k, n;
+    for (pass = 0; pass < 3; pass++)
+    {
+	for (k = 0, at = upin.data + sizeof(uph); k < uph.nclients; k++)
+	{
+	    name = at + sizeof(u);
+	    at = uprecord(at, end, &u);
+	    if (upowner(&u, k) != self->id)
+		continue;
+	    if (pass == 0)
+	    {
+		if (!(p = addclient(upin.fds[fdi + k])))
+		    continue; // closed
+		atomic_fetch_add_explicit(&nconns, 1, memory_order_relaxed); // held here now
+		memcpy(p->name, name, u.namelen);
+		p->name[u.namelen] = '\0';
+		p->namelen = u.namelen;
+		p->ft.hp = u.hp;
+		p->ft.pu = u.pu;
+		p->turn = u.turn;
+		p->yell = u.yell;
+		p->ready = u.ready;
+		p->rating = u.rating;
+		p->room = u.room;
+		p->matchid = u.matchid;
+		p->dice.state = u.dice[0];
+		p->dice.inc = u.dice[1];
+		p->heard = u.heard; // idle_fired() goes by this
+		if (u.deadline)
+		    timer_arm(&wheel, &p->deadline, u.deadline > wheel.now ? u.deadline - wheel.now : 1);
+		in = name + u.namelen;
+		if (u.inlen) // a partial line, or lines left for this shard
+		{
+		    p->in = ring_get();
+		    cnt = ring_space(p->in, iov);
+		    for (n = 0, i = 0; i < cnt && n < u.inlen; i++)
+		    {
+			size_t m = iov[i].iov_len < u.inlen - n ? iov[i].iov_len : u.inlen - n;
+			memcpy(iov[i].iov_base, in + n, m);
+			n += m;
+		    }
+		    ring_fill(p->in, u.inlen);
+		}
+		if (u.outlen) // what the old process hadn't sent yet goes first
+		    queuemsg(p, in + u.inlen, u.outlen);
+		p->nowfd = -5;
+		p->lastfd = -5;
+	    }
+	    else if (!(p = getclient(upfdof(u.fd))))
+		continue; // lost in the first pass
+	    else if (pass == 1)
+	    {
+		if (u.nowfd != -5 && (q = getclient(upfdof(u.nowfd))))
+		    p->nowfd = q->fd;
+		if ((q = getclient(upfdof(u.lastfd))))
+		    p->lastfd = q->fd;
+		if (p->room >= 0) // the room was told when p arrived
+		{
+		    clist_append(&getroom(p->room)->members, p);
+		    p->inroom = 1;
+		}
+	    }
+	    else
+	    {
+		if (u.nowfd != -5 && p->nowfd == -5)
+		    endgame(p, NULL); // the opponent was lost, p wins
+		if (u.watching >= 0 && (q = getclient(upfdof(u.watching))) && q->nowfd != -5)
+		{
+		    p->watching = q;
+		    clist_append(&q->watchers, p);
+		    nwatching++;
+		}
+		else if (p->name[0] && p->nowfd == -5 && !p->ready && !p->queued)
+		    p->ready = 1; // it watched the lost one
+		if (p->name[0] && p->ready && p->nowfd == -5 && !p->queued)
+		{
+		    p->since = u.since; // its window keeps widening
+		    enqueue(p);
+		}
+		process_input(p);
+	    }
+	}
+    }
+}
+
+//--------------------------------------------------------------------------------------
+
+// This function listens on uppath for a new process to take over
+static void upsetup(void)
+{
+    if ((upfd = upgrade_listen(uppath)) < 0)
+	unix_error(uppath);
+    if (useuring)
+	uring_poll(upfd, UPOLLTAG(upfd));
+    else if (reactor_add(upfd, RE_READ) < 0)
+	exit(1);
+}
+
+//--------------------------------------------------------------------------------------
+
+// This function accepts a new process on upfd and tells every shard to stop at the end of
+// its loop iteration, where handover() takes over
+static void startupgrade(void)
+{
+    struct xmsg *m;
+    int s, i;
+    if ((s = accept4(upfd, NULL, NULL, SOCK_CLOEXEC)) < 0)
+    {
+	perror("upgrade accept");
+	return;
+    }
+    if (freezing)
+    {
+	close(s); // one upgrade at a time
+	return;
+    }
+    upconn = s;
+    freezing = 1;
+    for (i = 0; i < nshards; i++)
+    {
+	if (i == self->id)
+	    continue;
+	if (!(m = malloc(sizeof(struct xmsg))))
+	{
+	    fprintf(stderr, "out of memory!\n");
+	    exit(1);
+	}
+	m->kind = XUPGRADE;
+	post(i, m);
+    }
+}
+
+//--------------------------------------------------------------------------------------
+
+// This function hands this shard's clients to the new process, with every other shard:
+// once all of them are here nobody hands players between shards any more, so each takes
+// the ones on their way to it, lets what is in flight finish and writes its snapshot,
+// which shard 0 sends. If the new process has it all, this process is done; if not,
+// every shard carries on where it was.
+static void handover(void)
+{
+    pthread_barrier_wait(&stopbar); // every shard is done posting
+    receive(); // players handed here on the way
+    if (useuring)
+	drain();
+    flushrooms();
+    flushall(); // with io_uring nothing is sent any more, it goes in the snapshot
+    rec_flush();
+    snapshot(&self->up);
+    pthread_barrier_wait(&stopbar); // every snapshot is written
+    if (self->id == LOBBY)
+	upresult = sendall();
+    pthread_barrier_wait(&stopbar); // and upresult is known
+    if (upresult == 0)
+    {
+	if (self->id == LOBBY)
+	{
+	    fprintf(stderr, "upgrade: handed over, exiting\n");
+	    exit(0);
+	}
+	for (;;)
+	    pause(); // until shard 0 exits
+    }
+    if (self->id == LOBBY)
+	fprintf(stderr, "upgrade failed (%s), carrying on\n", strerror(upresult));
+    resume();
+}
+
+//--------------------------------------------------------------------------------------
+
+// This function cancels the accepts and every client's operations (io_uring) and handles
+// completions until none are in flight, so nothing reaches this process after its snapshot
+// Clients accepted meanwhile are cancelled too
+static void drain(void)
+{
+    struct client *p;
+    int busy;
+    if (accepting)
+	uring_cancel(listenfd);
+    do
+    {
+	busy = accepting;
+	for (p = clients.head; p; p = p->link.next)
+	    busy |= !quiesce(p);
+	if (busy)
+	    uring_events(-1);
+    } while (busy);
+}
+
+//--------------------------------------------------------------------------------------
+
+// This function writes a record for each of this shard's clients into b, followed by its
+// name, its buffered input and its unsent output, and adds its socket to b's descriptors
+static void snapshot(struct upbuf *b)
+{
+    char in[RINGSIZE];
+    struct upclient u;
+    struct outseg *seg;
+    struct client *p;
+    for (p = clients.head; p; p = p->link.next)
+    {
+	memset(&u, 0, sizeof(u));
+	u.fd = p->fd;
+	u.nowfd = p->nowfd;
+	u.lastfd = p->lastfd;
+	u.watching = p->watching ? p->watching->fd : -1;
+	u.hp = p->ft.hp;
+	u.pu = p->ft.pu;
+	u.rating = p->rating;
+	u.room = p->room;
+	u.matchid = p->matchid;
+	u.turn = p->turn;
+	u.yell = p->yell;
+	u.ready = p->ready;
+	u.dice[0] = p->dice.state;
+	u.dice[1] = p->dice.inc;
+	u.deadline = p->deadline.armed ? p->deadline.expires : 0;
+	u.heard = p->heard;
+	u.since = p->since;
+	u.namelen = p->name[0] ? p->namelen : 0;
+	u.inlen = p->in ? ring_peek(p->in, in) : 0;
+	for (seg = p->ohead; seg; seg = seg->next)
+	    u.outlen += seg->len - seg->off;
+	upbuf_add(b, &u, sizeof(u));
+	upbuf_add(b, p->name, u.namelen);
+	upbuf_add(b, in, u.inlen);
+	for (seg = p->ohead; seg; seg = seg->next)
+	    upbuf_add(b, seg->buf + seg->off, seg->len - seg->off);
+	upbuf_addfd(b, p->fd);
+    }
+    self->nextmatch = self->id + nshards * matches;
+}
+
+//--------------------------------------------------------------------------------------
+
+// This function sends the listeners and every shard's snapshot to the new process (shard 0)
+// It returns 0 once the new process has them, or the errno it failed with
+static int sendall(void)
+{
+    struct upbuf b = { 0 };
+    struct uphdr h = { UPMAGIC, UPVERSION, nshards, statsfd >= 0, 0, 0 };
+    int i, j, err = 0;
+    for (i = 0; i < nshards; i++)
+    {
+	h.nclients += shards[i].up.nfds;
+	if (shards[i].nextmatch > h.nextmatch)
+	    h.nextmatch = shards[i].nextmatch;
+	upbuf_addfd(&b, shards[i].listenfd);
+    }
+    if (statsfd >= 0)
+	upbuf_addfd(&b, statsfd);
+    upbuf_add(&b, &h, sizeof(h));
+    for (i = 0; i < nshards; i++)
+    {
+	upbuf_add(&b, shards[i].up.data, shards[i].up.len);
+	for (j = 0; j < shards[i].up.nfds; j++)
+	    upbuf_addfd(&b, shards[i].up.fds[j]);
+    }
+    if (upgrade_send(upconn, &b) < 0)
+	err = errno ? errno : EPROTO;
+    upbuf_free(&b);
+    close(upconn);
+    upconn = -1;
+    return err;
+}
+
+//--------------------------------------------------------------------------------------
+
+// This function picks up where this shard left off before a handover that failed:
+// with io_uring, input and output start flowing again and new connections are accepted
+static void resume(void)
+{
+    struct client *p;
+    upbuf_free(&self->up);
+    freezing = 0;
+    if (!useuring)
+	return; // nothing was stopped
+    for (p = clients.head; p; p = p->link.next)
+    {
+	if (!p->recving)
+	{
+	    uring_recv(p->fd, UTAG(p, UK_RECV));
+	    p->inflight++;
+	    p->recving = 1;
+	}
+	p->leaving = 0; // one on handq is quiesced again by handoff()
+	if (p->ohead && !p->dirty)
+	{
+	    clist_append(&flushq, p);
+	    p->dirty = 1;
+	}
+    }
+    if (!accepting)
+    {
+	uring_accept(listenfd, UK_ACCEPT);
+	accepting = 1;
+    }
+}
+
+//============================================
+// Snapshot Functions
+//============================================
+
+// This function tells every shard to stop at the end of its loop iteration, where snapstop()
+// forks; it is skipped while an upgrade is on or the last snapshot's child is still writing
+static void snapfired(struct timer *t)
+{
+    struct xmsg *m;
+    int i;
+    timer_arm(&wheel, t, SECS(snapsecs));
+    if (freezing || snapping)
+	return;
+    if (snappid > 0)
+    {
+	if (waitpid(snappid, NULL, WNOHANG) == 0)
+	    return; // the disk can't keep up, skip one
+	snappid = 0;
+    }
+    snapping = 1;
+    for (i = 0; i < nshards; i++)
+    {
+	if (i == self->id)
+	    continue;
+	if (!(m = malloc(sizeof(struct xmsg))))
+	{
+	    fprintf(stderr, "out of memory!\n");
+	    exit(1);
+	}
+	m->kind = XSNAP;
+	post(i, m);
+    }
+}
+
+//--------------------------------------------------------------------------------------
+
+// This function stops this shard with every other one while shard 0 forks: between loop
+// iterations every list is whole, and the child gets a copy-on-write image of all of them
+// The shards stand still for the slowest one's iteration and the fork (st.fork), not for the
+// writing. A player on its way to another shard (an XCLIENT not received yet) is left out.
+static void snapstop(void)
+{
+    uint64_t t0 = stats_now();
+    pid_t pid;
+    pthread_barrier_wait(&stopbar); // every shard is between iterations
+    if (self->id == LOBBY)
+    {
+	if ((pid = fork()) == 0)
+	    _exit(snapwrite() < 0 ? 1 : 0); // no atexit(), no stdio flushed twice
+	if (pid < 0)
+	    perror("snapshot fork");
+	else
+	{
+	    snappid = pid;
+	    st.snapshots++;
+	}
+    }
+    pthread_barrier_wait(&stopbar); // the child has its image
+    if (self->id == LOBBY)
+	hist_add(&st.fork, stats_now() - t0);
+    snapping = 0;
+}
+
+//--------------------------------------------------------------------------------------
+
+// This function writes every named player on every shard to snappath, in the child
+// Only the thread that forked exists here; the other shards' lists are read as they were
+// It returns 0, or -1 on error
+static int snapwrite(void)
+{
+    struct snapw w;
+    struct snaprec r;
+    struct client *p;
+    int i, next = 0;
+    if (snap_open(&w, snappath) < 0)
+	return -1;
+    for (i = 0; i < nshards; i++)
+    {
+	if (i + nshards * *shards[i].matches > next)
+	    next = i + nshards * *shards[i].matches; // above every id shard i gave out
+	for (p = shards[i].clients->head; p; p = p->link.next)
+	{
+	    if (!p->name[0])
+		continue; // nothing to come back to
+	    memset(&r, 0, sizeof(r));
+	    memcpy(r.name, p->name, p->namelen);
+	    r.rating = p->rating;
+	    r.room = p->room;
+	    r.matchid = -1;
+	    if (p->nowfd != -5)
+	    {
+		r.matchid = p->matchid;
+		r.hp = p->ft.hp;
+		r.pu = p->ft.pu;
+		r.turn = p->turn;
+		r.dice[0] = p->dice.state;
+		r.dice[1] = p->dice.inc;
+	    }
+	    snap_add(&w, &r);
+	}
+    }
+    return snap_close(&w, next);
+}
+
+//--------------------------------------------------------------------------------------
+
+// This function maps the snapshot on snappath, before any shard runs
+// Match ids carry on from it; a missing or broken snapshot is a fresh start
+static void snaprestore(void)
+{
+    uint64_t t0 = stats_now();
+    int64_t when;
+    int32_t next;
+    int n;
+    if ((n = snap_load(snappath, &next, &when)) < 0)
+    {
+	fprintf(stderr, "restore: no snapshot in %s, starting afresh\n", snappath);
+	return;
     }
-    p->fd = fd;
-    p->bytesleft = MAXBUF; // Initialize as MAXBUF
-    p->nextpos = NULL;// Initialize as NULL
-    p->name[0] = '\0'; // Null terminate the name
-    // Combat variables
-    p->ready = 1; // new client is ready to play
-    p->turn = 0; // not this client's turn
-    p->nowfd = -5; // -5 => not playing, other number => currently playing
-    p->lastfd = -5; //
-		    // ( negative number since fd will never be negative)
-    p->hp = 0; // hit point
-    p->pu = 0; // powerups
-    // pointer to next node
-    p->next = top;
-    top = p; // P is now first in the list
+    if (!(slots = calloc(n ? n : 1, sizeof(*slots))))
+    {
+	fprintf(stderr, "out of memory!\n");
+	exit(1);
+    }
+    matchbase = next;
+    fprintf(stderr, "restore: %d players from %s, taken %lds ago, in %.1f ms\n", n, snappath,
+	    (long)(time(NULL) - when), (stats_now() - t0) / 1e6);
 }
 
 //--------------------------------------------------------------------------------------
 
-// This function removes a client
-static void removeclient(struct client *p)
+// This function carries on p's match from the snapshot, p being back under its old name
+// in its old room: if its opponent is back too (and waiting here, both are in the room) the
+// battle resumes, if not p waits for it RESUMESECS. A player that wasn't playing, or whose
+// opponent gave up waiting, is matched as usual
+// It returns 1 if p plays or waits, 0 if p is to be matched
+static int rejoin(struct client *p)
 {
-    struct client **pp, *t;
-    for (pp = &top; *pp && *pp != p; pp = &(*pp)->next)
-	; // do nothing
-    // Here, either we are at end of list or at pp.
-    if (*pp) // If we are at pp
+    const struct snaprec *r = p->resume, *o = snap_partner(r);
+    struct snapslot *mine = &slots[snap_index(r)], *theirs = o ? &slots[snap_index(o)] : NULL;
+    struct client *q;
+    if (mine->held == p)
+	return 1; // still waiting
+    if (!o || theirs->done)
     {
-	close((*pp)->fd); // close the file descriptor
-	t = (*pp)->next; // t points to pp->next
-	free(*pp); // free pp
-	*pp = t; // let pointer pointing to pp point to next
+	mine->done = 1;
+	p->resume = NULL;
+	return 0;
     }
-    else
+    if (!(q = theirs->held))
     {
-	// Error
-	fprintf(stderr, "Trying to remove fd %d, it isn't in the list\n", p->fd);
-	fflush(stderr);
+	mine->held = p;
+	queuestr(p, resumewait);
+	timer_arm(&wheel, &p->deadline, SECS(RESUMESECS));
+	return 1;
     }
+    theirs->held = NULL;
+    mine->done = theirs->done = 1;
+    q->resume = p->resume = NULL;
+    timer_cancel(&wheel, &q->deadline);
+    resume_match(q, p, o, r);
+    return 1;
 }
 
 //--------------------------------------------------------------------------------------
 
-// This function returns a client based on the fd given
-struct client *getclient(int fd)
+// This function stops p waiting for its opponent from the snapshot: its match is over,
+// and the opponent won't wait for p if it comes back
+static void unhold(struct client *p)
+{
+    struct snapslot *mine = &slots[snap_index(p->resume)];
+    mine->held = NULL;
+    mine->done = 1;
+    p->resume = NULL;
+}
+
+//============================================
+// Timer Functions
+//============================================
+
+// This function returns how long the game loop may wait before a deadline is due, in ms
+static int nexttimeout(void)
+{
+    int64_t n = wheel_next(&wheel);
+    return n < 0 ? -1 : (int)(n * TICKMS);
+}
+
+//--------------------------------------------------------------------------------------
+
+// This function starts p's turn clock, it is stopped when the turn is played or the game ends
+static void startclock(struct client *p)
 {
-    struct client **p = &top;
-    while(*p)
+    if (movesecs)
+	timer_arm(&wheel, &p->deadline, SECS(movesecs));
+}
+
+//--------------------------------------------------------------------------------------
+
+// This function handles a client's deadline:
+// without a name it is dropped, in a match it forfeits (and both go back to waiting),
+// waiting for its opponent from the snapshot it stops waiting
+static void deadline_fired(struct timer *t)
+{
+    struct client *p = (struct client *)((char *)t - offsetof(struct client, deadline));
+    struct client *q;
+    st.timeouts++;
+    if (!p->name[0])
+    {
+	farewell(p, namedeadline);
+	dropclient(p);
+    }
+    else if (p->turn && (q = getclient(p->nowfd)))
+    {
+	queuestr(p, movedeadline);
+	queuestr(q, opponentdeadline);
+	endgame(q, p); // q wins
+    }
+    else if (p->resume) // its opponent from the snapshot didn't come back
     {
-	if (((*p)->fd == fd))
-	    return (*p);
-	p =&(*p)->next;
+	unhold(p);
+	if (!p->watching)
+	    ready_join(p); // a spectator waits when the battle ends
     }
-    return NULL;// client not found
 }
 
 //--------------------------------------------------------------------------------------
 
-// This function reads the current client to the end of the linked list
-static void requeue(struct client *p)
+// This function drops a client that has sent nothing for idlesecs
+// Input only records the tick (p->heard), so a client that did send something
+// has its check moved to idlesecs after that instead
+static void idle_fired(struct timer *t)
 {
-    struct client *prev, *after, *final;
-    for (final = top; final->next; final = final->next)
-	; // let final point to the final node
-    prev = top;
-    if(prev == p) // if the client is the first node
-    { // in this case, prev is p
-	top = prev->next; // update top to point to 2nd node
-			  // to make 2nd node first node
-	final->next = prev; //make final next point to first node
-	prev->next = NULL; // make first node next point to null
+    struct client *p = (struct client *)((char *)t - offsetof(struct client, idle));
+    uint64_t due = p->heard + SECS(idlesecs);
+    if (due > wheel.now)
+    {
+	timer_arm(&wheel, &p->idle, due - wheel.now);
 	return;
     }
-    // here, client is not the first node
-    for (prev = top; prev && prev->next != p; prev = prev->next)
-        ; // Try and let pp->next point to p
-    // Here, either we are at end of list or at p using pp->next
-    if (prev) // If we are at prev
+    st.timeouts++;
+    farewell(p, idledeadline);
+    dropclient(p);
+}
+
+//--------------------------------------------------------------------------------------
+
+// This function runs when a waiting client's retry clock runs out: its window has widened,
+// so it may reach someone now; if not, it looks again in RETRYSECS
+static void retry_fired(struct timer *t)
+{
+    struct client *p = (struct client *)((char *)t - offsetof(struct client, retry));
+    struct client *q = nearest(p);
+    if (!q)
     {
-        after = prev->next->next; // after points to p->next
-	final->next = prev->next; // make the last node point to p
-        (prev)->next = after; // make pointer before p point to p->next
-	final->next->next = NULL; // make p->next point to NULL
+	timer_arm(&wheel, &p->retry, SECS(RETRYSECS));
 	return;
     }
+    dequeue(p);
+    dequeue(q);
+    if (q->since < p->since)
+	initialize_match(q, p); // whoever waited longer attacks first
     else
-    {
-        // Error
-        fprintf(stderr, "Trying to remove fd %d, it isn't in the list\n", p->fd);
-        fflush(stderr);
-    }
+	initialize_match(p, q);
+}
+
+//--------------------------------------------------------------------------------------
+
+// This function writes s straight to p, which is about to be dropped (its queue is discarded)
+// If output is still queued, s would arrive out of order and is not sent
+static void farewell(struct client *p, const char *s)
+{
+    if (!p->ohead && write(p->fd, s, strlen(s)) < 0)
+	return; // p is going anyway
 }
 
 //============================================
@@ -703,29 +2829,73 @@ void initialize_match(struct client *p1, struct client *p2)
     p2->nowfd = p1->fd;
     p1->lastfd = p2->fd; // will be -5 if not playing
     p2->lastfd = p1->fd;
-    p1->hp = (rand() % MAXHP) + 20; // Player 1's hit points
-    p2->hp = (rand() % MAXHP) + 20; // Player 2's hit points
-    p1->pu = (rand() % MAXPU) + 2; // Player 1's number of Power Ups
-    p2->pu = (rand() % MAXPU) + 2; // Player 2's number of Power Ups
+    // Each side rolls from its own stream of the match, so the rolls only depend on
+    // seedbase, the match id and the moves, not on what else the shard is doing
+    p1->matchid = p2->matchid = self->id + nshards * matches++;
+    engine_seed(&p1->dice, seedbase, 2 * (uint64_t)p1->matchid);
+    engine_seed(&p2->dice, seedbase, 2 * (uint64_t)p1->matchid + 1);
+    engine_start(&p1->ft, &p2->ft, &p1->dice); // roll hp and pu
+    st.started++;
     p1->turn = 1; // player 1 always start first (the player closer to the beginning of the linked list)
-    char begin[MAXBUF];
-    sprintf(begin, beginbattle, p1->name, p2->name);
-    Writen(p1->fd, begin, strlen(begin));
-    Writen(p2->fd, begin, strlen(begin));
-    char remainp1[MAXBUF];
-    char remainp2[MAXBUF];
-    char enemyremains1[MAXBUF];
-    char enemyremains2[MAXBUF];
-    sprintf(enemyremains1, enemyremains, p2->hp);
-    sprintf(enemyremains2, enemyremains, p1->hp);
-    sprintf(remainp1, remains, p1->hp, p1->pu);
-    sprintf(remainp2, remains, p2->hp, p2->pu);
-    Writen(p1->fd, enemyremains1, strlen(enemyremains1));
-    Writen(p2->fd, enemyremains2, strlen(enemyremains2));
-    Writen(p1->fd, remainp1, strlen(remainp1));
-    Writen(p2->fd, remainp2, strlen(remainp2));
-    Writen(p1->fd, moves1, strlen(moves1));
-    Writen(p2->fd, waitmoves, strlen(waitmoves));
+    startclock(p1);
+    openmatch(p1, p2, &tbegin);
+}
+
+//--------------------------------------------------------------------------------------
+
+// This function carries on the match p1 and p2 were playing in the snapshot (r1 and r2),
+// with the hit points, power ups, dice and match id it had; whoever's turn it was plays
+static void resume_match(struct client *p1, struct client *p2, const struct snaprec *r1, const struct snaprec *r2)
+{
+    if (!r1->turn && r2->turn)
+    {
+	resume_match(p2, p1, r2, r1); // p1 is the one to play
+	return;
+    }
+    if (p1->watching) // watching while it waited
+	unwatch(p1);
+    if (p2->watching)
+	unwatch(p2);
+    p1->ready = 0;
+    p2->ready = 0;
+    p1->nowfd = p2->fd;
+    p2->nowfd = p1->fd;
+    p1->lastfd = p2->fd;
+    p2->lastfd = p1->fd;
+    p1->matchid = p2->matchid = r1->matchid;
+    p1->ft.hp = r1->hp;
+    p1->ft.pu = r1->pu;
+    p2->ft.hp = r2->hp;
+    p2->ft.pu = r2->pu;
+    p1->dice.state = r1->dice[0];
+    p1->dice.inc = r1->dice[1];
+    p2->dice.state = r2->dice[0];
+    p2->dice.inc = r2->dice[1];
+    st.started++;
+    p1->turn = 1;
+    startclock(p1);
+    openmatch(p1, p2, &tresume);
+}
+
+//--------------------------------------------------------------------------------------
+
+// This function queues what both players of a match are told as it starts (t, with both
+// names and the match id) or resumes: each side's hit points, and p1 its options
+static void openmatch(struct client *p1, struct client *p2, const struct tmpl *t)
+{
+    struct targ names[3] = { TSTR(p1->name, p1->namelen), TSTR(p2->name, p2->namelen), TINT(p1->matchid) };
+    struct targ hp1[1] = { TINT(p1->ft.hp) }, hp2[1] = { TINT(p2->ft.hp) };
+    struct targ left1[2] = { TINT(p1->ft.hp), TINT(p1->ft.pu) }, left2[2] = { TINT(p2->ft.hp), TINT(p2->ft.pu) };
+    queuetmpl(p1, p2, t, names); // rendered once for both
+    queuetmpl(p1, NULL, &tenemy, hp2);
+    queuetmpl(p2, NULL, &tenemy, hp1);
+    queuetmpl(p1, NULL, &tremains, left1);
+    queuetmpl(p2, NULL, &tremains, left2);
+    if (p1->ft.pu > 0)
+	queuestr(p1, moves1);
+    else
+	queuestr(p1, moves2);
+    queuestr(p2, waitmoves);
 }
 
 //--------------------------------------------------------------------------------------
@@ -733,34 +2903,8 @@ void initialize_match(struct client *p1, struct client *p2)
 // This function generates normal (a)ttack
 void attack(struct client *p1, struct client *p2)
 {
-    char enemyremains1[MAXBUF];
-    char enemyremains2[MAXBUF];
-    char remainp1[MAXBUF];
-    char remainp2[MAXBUF];
-    char damage1[MAXBUF];
-    char damage2[MAXBUF];
-    int admg = normaldmg();
-    p2->hp -= admg;
-    // send damage message
-    sprintf(damage1, damage, p1->name, admg, p2->name);
-    sprintf(damage2, damage, p1->name, admg, p2->name);
-    Writen(p1->fd, damage1, strlen(damage1));
-    Writen(p2->fd, damage2, strlen(damage2));
-    // send remain message
-    sprintf(enemyremains1, enemyremains, p2->hp);
-    sprintf(enemyremains2, enemyremains, p1->hp);
-    Writen(p1->fd, enemyremains1, strlen(enemyremains1));
-    Writen(p2->fd, enemyremains2, strlen(enemyremains2));
-    sprintf(remainp1, remains, p1->hp, p1->pu);
-    sprintf(remainp2, remains, p2->hp, p2->pu);
-    Writen(p1->fd, remainp1, strlen(remainp1));
-    Writen(p2->fd, remainp2, strlen(remainp2));
-    // send wait & moves message
-    Writen(p1->fd, waitmoves, strlen(waitmoves));
-    if (p2->pu > 0)
-	Writen(p2->fd, moves1, strlen(moves1));
-    else
-	Writen(p2->fd, moves2, strlen(moves2));
+    int admg = engine_attack(&p1->ft, &p2->ft, &p1->dice);
+    turnreport(p1, p2, admg);
     return; // update turns in read_process()
 }
 
@@ -770,43 +2914,47 @@ void attack(struct client *p1, struct client *p2)
 // It returns 1 if successful and 0 if not ( no powerups left)
 int powerup(struct client *p1, struct client *p2)
 {
-    char enemyremains1[MAXBUF];
-    char enemyremains2[MAXBUF];
-    char remainp1[MAXBUF];
-    char remainp2[MAXBUF];
-    char damage1[MAXBUF];
-    char damage2[MAXBUF];
-    // check powerup
-    if ( p1->pu == 0)
+    // check powerup & do powerup
+    int pdmg = engine_powerup(&p1->ft, &p2->ft, &p1->dice);
+    if (pdmg < 0)
         return 0;
     else
+	turnreport(p1, p2, pdmg);
+    return 1; // update turns in read_process()
+}
+
+//--------------------------------------------------------------------------------------
+
+// This function sends both players what p1's turn did: the damage (the same line for both,
+// rendered once), what each has left, and whose move it is now
+static void turnreport(struct client *p1, struct client *p2, int dmg)
+{
+    struct targ hit[3] = { TSTR(p1->name, p1->namelen), TINT(dmg), TSTR(p2->name, p2->namelen) };
+    struct targ hp1[1] = { TINT(p1->ft.hp) }, hp2[1] = { TINT(p2->ft.hp) };
+    struct targ left1[2] = { TINT(p1->ft.hp), TINT(p1->ft.pu) }, left2[2] = { TINT(p2->ft.hp), TINT(p2->ft.pu) };
+    // send damage message
+    queuetmpl(p1, p2, &tdamage, hit);
+    // send remain message
+    queuetmpl(p1, NULL, &tenemy, hp2);
+    queuetmpl(p2, NULL, &tenemy, hp1);
+    queuetmpl(p1, NULL, &tremains, left1);
+    queuetmpl(p2, NULL, &tremains, left2);
+    // send wait & moves message
+    queuestr(p1, waitmoves);
+    if (p2->ft.pu > 0)
+	queuestr(p2, moves1);
+    else
+	queuestr(p2, moves2);
+    // and the spectators one frame with the damage and both players' hp
+    if (watched(p1, p2))
     {
-	// do powerup
-	p1->pu--;
-	int pdmg = powerdmg();
-	p2->hp -= pdmg;
-	// send damage message
-	sprintf(damage1, damage, p1->name, pdmg, p2->name);
-    	sprintf(damage2, damage, p1->name, pdmg, p2->name);
-	Writen(p1->fd, damage1, strlen(damage1));
-	Writen(p2->fd, damage2, strlen(damage2));
-	// send remain message
-	sprintf(enemyremains1, enemyremains, p2->hp);
-	sprintf(enemyremains2, enemyremains, p1->hp);
-	Writen(p1->fd, enemyremains1, strlen(enemyremains1));
-	Writen(p2->fd, enemyremains2, strlen(enemyremains2));
-	sprintf(remainp1, remains, p1->hp, p1->pu);
-	sprintf(remainp2, remains, p2->hp, p2->pu);
-    	Writen(p1->fd, remainp1, strlen(remainp1));
-    	Writen(p2->fd, remainp2, strlen(remainp2));
-    	// send wait & moves message
-    	Writen(p1->fd, waitmoves, strlen(waitmoves));
-    	if (p2->pu > 0)
-            Writen(p2->fd, moves1, strlen(moves1));
-    	else
-            Writen(p2->fd, moves2, strlen(moves2));
+	struct targ hp[4] = { TSTR(p1->name, p1->namelen), TINT(p1->ft.hp), TSTR(p2->name, p2->namelen), TINT(p2->ft.hp) };
+	struct frame *f = frame_get();
+	frame_add(f, &tdamage, hit);
+	frame_add(f, &twatchhp, hp);
+	watchcast(p1, p2, f);
+	frame_put(f);
     }
-    return 1; // update turns in read_process()
 }
 
 //--------------------------------------------------------------------------------------
@@ -822,54 +2970,491 @@ void yell(struct client *p1)
 // This function ends the game if p1 is the winner and p2 is the loser
 void endgame(struct client *p1, struct client *p2)
 {
+    st.finished++;
+    if (p2) // a player who leaves takes its rating with it
+	rating_update(&p1->rating, &p2->rating);
+    timer_cancel(&wheel, &p1->deadline); // whoever's turn it was
+    if (p2)
+	timer_cancel(&wheel, &p2->deadline);
     // Display win message
-    Writen(p1->fd, winner, strlen(winner));
+    queuestr(p1, winner);
     // Update Variables
     p1->ready = 1; // p1 is ready to play now
     p1->nowfd = -5; // currently not playing
-    p1->hp = 0;
-    p1->pu = 0;
+    p1->ft.hp = 0;
+    p1->ft.pu = 0;
     p1->turn = 0;
     p1->yell = 0;
-    Writen(p1->fd, waitmsg, strlen(waitmsg));
-    requeue(p1);
+    queuestr(p1, waitmsg);
     if (p2) // if p2 is not NULL (did not lose by leaving)
     {
 	// Display lose message
-	Writen(p2->fd, loser, strlen(loser));
+	queuestr(p2, loser);
 	// Update variables
 	p2->ready = 1; // p2 is now ready to play
 	p2->nowfd = -5; // currently not playing
-	p2->hp = 0;
-	p2->pu = 0;
+	p2->ft.hp = 0;
+	p2->ft.pu = 0;
 	p2->turn = 0;
 	p2->yell = 0;
-	Writen(p2->fd, waitmsg, strlen(waitmsg));
+	queuestr(p2, waitmsg);
+    }
+    // Requeue once both are reset, so neither is matched before its result is sent
+    requeue(p1);
+    if (p2)
 	requeue(p2);
+    // Then the spectators, who go back to waiting too
+    if (watched(p1, p2))
+    {
+	struct targ a[1] = { TSTR(p1->name, p1->namelen) };
+	struct frame *f = frame_get();
+	frame_add(f, &twatchwon, a);
+	endwatch(p1, f);
+	if (p2)
+	    endwatch(p2, f);
+	frame_put(f);
     }
     return;
 }
 
+//============================================
+// Spectator Functions
+//============================================
+
+// This function makes p a spectator of the battle the player called name is in,
+// if that player is in p's room and playing
+// p stops waiting for a match until the battle ends
+static void watch(struct client *p, const char *name)
+{
+    struct client *q;
+    struct targ a[1] = { TSTR(name, strlen(name)) };
+    if (!p->inroom)
+	return; // still on its way to its room's shard
+    for (q = getroom(p->room)->members.head; q; q = q->mlink.next)
+    {
+	if (q != p && q->nowfd != -5 && !strcmp(q->name, name))
+	    break;
+    }
+    if (!q)
+    {
+	queuetmpl(p, NULL, &tnowatch, a);
+	return;
+    }
+    if (p->watching)
+	unwatch(p); // switching battles
+    if (p->queued) // not waiting while watching
+	dequeue(p);
+    p->ready = 0;
+    p->watching = q;
+    p->skips = 0;
+    clist_append(&q->watchers, p);
+    nwatching++;
+    queuetmpl(p, NULL, &twatch, a);
+}
+
 //--------------------------------------------------------------------------------------
 
-// This function generates a normal damage
-int normaldmg()
+// This function takes p off the watchers of the player it watches
+static void unwatch(struct client *p)
 {
-    return ((rand() % MAXATK) + 2); // 2-6 dmg
+    clist_remove(&p->watching->watchers, p);
+    p->watching = NULL;
+    nwatching--;
 }
 
 //--------------------------------------------------------------------------------------
 
-// This function generates a powerup damage
-int powerdmg()
+// This function queues f for every spectator of p (whose battle is over),
+// and puts them back to waiting for a match
+static void endwatch(struct client *p, struct frame *f)
 {
-    int dmg = normaldmg();
-    dmg *= 3; // triple the normal damage generated (6-18 dmg)
-    int acc = rand() % 2; // 50 % accuracy
-    if (acc == 0)
-	return 0;
-    // acc == 1
-    return dmg;
+    struct client *w;
+    while ((w = p->watchers.head))
+    {
+	queueframe(w, f);
+	unwatch(w);
+	w->ready = 1;
+	queuestr(w, waitmsg);
+	requeue(w);
+    }
+}
+
+//--------------------------------------------------------------------------------------
+
+// This function returns 1 if p1 or p2 (which may be NULL) has spectators,
+// so frames are only rendered for battles someone watches
+static int watched(struct client *p1, struct client *p2)
+{
+    return p1->watchers.n || (p2 && p2->watchers.n);
+}
+
+//--------------------------------------------------------------------------------------
+
+// This function returns an empty frame that the caller holds once
+static struct frame *frame_get(void)
+{
+    struct frame *f;
+    if ((f = framefree))
+	framefree = f->next;
+    else if (!(f = malloc(sizeof(struct frame))))
+    {
+	fprintf(stderr, "out of memory!\n");
+	exit(1);
+    }
+    f->refs = 1;
+    f->len = 0;
+    st.frames++;
+    return f;
+}
+
+// This function renders t with a onto the end of f
+// (a frame holds at most two rendered messages, which always fit)
+static void frame_add(struct frame *f, const struct tmpl *t, const struct targ *a)
+{
+    f->len += tmpl_render(t, f->data + f->len, a);
+}
+
+// This function drops one hold on f, which is freed with the last
+static void frame_put(struct frame *f)
+{
+    if (--f->refs)
+	return;
+    f->next = framefree;
+    framefree = f;
+}
+
+//--------------------------------------------------------------------------------------
+
+// This function queues f for the spectators of p1 and of p2 (which may be NULL)
+static void watchcast(struct client *p1, struct client *p2, struct frame *f)
+{
+    struct client *w;
+    for (w = p1->watchers.head; w; w = w->wlink.next)
+	queueframe(w, f);
+    if (p2)
+	for (w = p2->watchers.head; w; w = w->wlink.next)
+	    queueframe(w, f);
+}
+
+//============================================
+// Output Functions
+//============================================
+
+// This function appends n bytes from s to p's output queue
+// Nothing is written until flushall() at the end of the loop iteration
+static void queuemsg(struct client *p, const char *s, size_t n)
+{
+    struct outseg *seg;
+    size_t room;
+    if (p->overflow || !hiwatok(p, n))
+	return; // p is being disconnected
+    p->opending += n;
+    while (n > 0)
+    {
+	seg = p->otail;
+	if (!seg || seg->len == OUTSEG || seg == p->sendtail || seg->frame) // need a fresh segment
+	    seg = newseg(p);
+	room = OUTSEG - seg->len;
+	if (room > n)
+	    room = n;
+	memcpy(seg->data + seg->len, s, room);
+	seg->len += room;
+	s += room;
+	n -= room;
+    }
+    if (!p->dirty) // flush p at the end of this loop iteration
+    {
+	clist_append(&flushq, p);
+	p->dirty = 1;
+    }
+}
+
+//--------------------------------------------------------------------------------------
+
+// This function renders t with the arguments a straight into p's output queue,
+// and queues the same bytes for q too if q is not NULL
+static void queuetmpl(struct client *p, struct client *q, const struct tmpl *t, const struct targ *a)
+{
+    char buf[OUTSEG];
+    char *s;
+    size_t n;
+    if ((s = queuespace(p, t->max)))
+    {
+	n = tmpl_render(t, s, a);
+	queuecommit(p, n); // s stays valid even if p just passed hiwat
+    }
+    else // p is being disconnected, but q may still want it
+	n = tmpl_render(t, s = buf, a);
+    if (q)
+	queuemsg(q, s, n);
+}
+
+//--------------------------------------------------------------------------------------
+
+// This function returns room for n contiguous bytes (n <= OUTSEG) at the end of p's queue,
+// starting a fresh segment if the last one hasn't got it, or NULL if p is being disconnected
+// Nothing is queued until queuecommit()
+static char *queuespace(struct client *p, size_t n)
+{
+    struct outseg *seg = p->otail;
+    if (p->overflow)
+	return NULL;
+    if (!seg || OUTSEG - seg->len < (int)n || seg == p->sendtail || seg->frame)
+	seg = newseg(p);
+    return seg->data + seg->len;
+}
+
+// This function queues the n bytes written at queuespace()
+static void queuecommit(struct client *p, size_t n)
+{
+    if (!hiwatok(p, n))
+	return;
+    p->otail->len += n;
+    p->opending += n;
+    if (!p->dirty) // flush p at the end of this loop iteration
+    {
+	clist_append(&flushq, p);
+	p->dirty = 1;
+    }
+}
+
+//--------------------------------------------------------------------------------------
+
+// This function appends an empty segment to p's queue and returns it
+static struct outseg *newseg(struct client *p)
+{
+    struct outseg *seg;
+    if ((seg = segfree))
+	segfree = seg->next;
+    else if (!(seg = malloc(sizeof(struct outseg))))
+    {
+	fprintf(stderr, "out of memory!\n");
+	exit(1);
+    }
+    seg->next = NULL;
+    seg->buf = seg->data;
+    seg->frame = NULL;
+    seg->len = seg->off = 0;
+    if (p->otail)
+	p->otail->next = seg;
+    else
+	p->ohead = seg;
+    p->otail = seg;
+    return seg;
+}
+
+// This function puts a segment that is done with back on the free list
+static void segput(struct outseg *seg)
+{
+    if (seg->frame)
+	frame_put(seg->frame);
+    seg->next = segfree;
+    segfree = seg;
+}
+
+//--------------------------------------------------------------------------------------
+
+// This function queues frame f on spectator p's output queue by reference
+// A spectator more than WATCHHIWAT bytes behind skips it instead, so a slow spectator
+// costs nothing but its own frames; WATCHSKIPS in a row and it is disconnected
+static void queueframe(struct client *p, struct frame *f)
+{
+    struct outseg *seg;
+    if (p->overflow)
+	return; // p is being disconnected
+    if (p->opending + f->len > WATCHHIWAT)
+    {
+	st.skipped++;
+	if (++p->skips >= WATCHSKIPS) // drop p at the flush
+	{
+	    fprintf(stderr, "fd %d skipped %d frames in a row\n", p->fd, WATCHSKIPS);
+	    p->overflow = 1;
+	    st.overflows++;
+	    if (!p->dirty)
+	    {
+		clist_append(&flushq, p);
+		p->dirty = 1;
+	    }
+	}
+	return;
+    }
+    p->skips = 0;
+    seg = newseg(p);
+    seg->buf = f->data;
+    seg->frame = f;
+    seg->len = f->len;
+    f->refs++;
+    p->opending += f->len;
+    if (!p->dirty) // flush p at the end of this loop iteration
+    {
+	clist_append(&flushq, p);
+	p->dirty = 1;
+    }
+}
+
+//--------------------------------------------------------------------------------------
+
+// This function returns 1 if p can take n more bytes of output
+// If not, p is not reading its output: nothing more is queued and p is dropped at the next flush
+static int hiwatok(struct client *p, size_t n)
+{
+    if (p->opending + n <= hiwat)
+	return 1;
+    fprintf(stderr, "fd %d exceeded %lu bytes of unsent output\n", p->fd, (unsigned long)hiwat);
+    p->overflow = 1;
+    st.overflows++;
+    if (!p->dirty)
+    {
+	clist_append(&flushq, p);
+	p->dirty = 1;
+    }
+    return 0;
+}
+
+//--------------------------------------------------------------------------------------
+
+// This function writes p's output queue with writev(), freeing the segments written
+// It returns 0 once the queue is empty or the socket is full, -1 on a write error
+static int flushclient(struct client *p)
+{
+    struct iovec iov[MAXIOV];
+    struct outseg *seg;
+    ssize_t n;
+    int cnt;
+    while (p->ohead)
+    {
+	// Gather up to MAXIOV segments
+	for (cnt = 0, seg = p->ohead; seg && cnt < MAXIOV; seg = seg->next, cnt++)
+	{
+	    iov[cnt].iov_base = seg->buf + seg->off;
+	    iov[cnt].iov_len = seg->len - seg->off;
+	}
+	if ((n = Writev(p->fd, iov, cnt)) < 0)
+	{
+	    if (errno == EAGAIN || errno == EWOULDBLOCK)
+		return 0; // socket buffer is full, the rest waits for RE_WRITE
+	    return -1;
+	}
+	p->opending -= n;
+	st.bytesout += n;
+	// Release what was written, a partial write leaves off set in the head segment
+	while (n > 0)
+	{
+	    seg = p->ohead;
+	    if (n < seg->len - seg->off)
+	    {
+		seg->off += n;
+		break;
+	    }
+	    n -= seg->len - seg->off;
+	    p->ohead = seg->next;
+	    segput(seg);
+	}
+	if (!p->ohead)
+	    p->otail = NULL;
+    }
+    return 0;
+}
+
+//--------------------------------------------------------------------------------------
+
+// This function flushes every client that had output queued
+// A client that can't be written to is dropped, which may queue more output
+// (to its opponent and everyone else), so the flush list is drained until empty
+// Clients left with pending output are watched for RE_WRITE until it drains
+static void flushall(void)
+{
+    struct client *p;
+    while ((p = flushq.head))
+    {
+	clist_remove(&flushq, p);
+	p->dirty = 0;
+	if (p->overflow)
+	{
+	    dropclient(p);
+	    continue;
+	}
+	if (useuring)
+	{
+	    // One chain at a time, the next goes out when this one completes;
+	    // a client being handed over is flushed by its next shard
+	    if (!p->sending && !p->leaving)
+		sendchain(p);
+	    continue;
+	}
+	if (flushclient(p) < 0)
+	{
+	    dropclient(p);
+	    continue;
+	}
+	if (p->ohead && !p->wantwrite)
+	{
+	    reactor_mod(p->fd, RE_READ | RE_WRITE);
+	    p->wantwrite = 1;
+	}
+	else if (!p->ohead && p->wantwrite)
+	{
+	    reactor_mod(p->fd, RE_READ);
+	    p->wantwrite = 0;
+	}
+    }
+}
+
+//--------------------------------------------------------------------------------------
+
+// This function queues up to MAXIOV of p's segments as linked sends (io_uring)
+// Each send waits for the one before it to send everything (MSG_WAITALL), so the bytes
+// go out in order; a send that fails cancels the rest of the chain. The segments stay
+// on p's queue until sent, and queuemsg() doesn't append to the last one in the chain.
+static void sendchain(struct client *p)
+{
+    struct outseg *seg;
+    int cnt = 0;
+    for (seg = p->ohead; seg && cnt < MAXIOV; seg = seg->next, cnt++)
+    {
+	uring_send(p->fd, seg->buf + seg->off, seg->len - seg->off,
+		seg->next && cnt < MAXIOV - 1, UTAG(p, UK_SEND));
+	p->sendtail = seg;
+    }
+    p->sending = cnt;
+    p->inflight += cnt;
+}
+
+//--------------------------------------------------------------------------------------
+
+// This function releases what one send of p's chain sent (res bytes, or -errno),
+// which is always from the head segment since the sends complete in order
+static void sent(struct client *p, int res)
+{
+    struct outseg *seg = p->ohead;
+    if (res <= 0)
+	return;
+    p->opending -= res;
+    st.bytesout += res;
+    seg->off += res;
+    if (seg->off < seg->len)
+	return; // a short send, the rest of the chain was cancelled
+    p->ohead = seg->next;
+    if (!p->ohead)
+	p->otail = NULL;
+    segput(seg);
+}
+
+//--------------------------------------------------------------------------------------
+
+// This function gets p ready to leave this shard: with io_uring, the operations on
+// its fd are cancelled, and it can go once their completions have all come back
+// It returns 1 if p can be detached now
+static int quiesce(struct client *p)
+{
+    if (!p->inflight)
+	return 1;
+    if (!p->leaving)
+    {
+	uring_cancel(p->fd);
+	p->leaving = 1;
+    }
+    return 0;
 }
 
 //============================================
@@ -0,0 +1,83 @@
+// The battle rules of the battleserver
+// Every roll comes from the caller's generator (a PCG32, see engine.h), so a match can be
+// replayed from its seed and stream, and threads and simulations share no state.
+#include "engine.h"
+
+#define PCG_MULT 6364136223846793005ULL // the 64-bit LCG multiplier PCG uses
+
+// This function seeds r: stream picks one of the independent sequences and seed where in
+// it r starts
+void engine_seed(struct rng *r, uint64_t seed, uint64_t stream)
+{
+    r->state = 0;
+    r->inc = (stream << 1) | 1; // must be odd
+    engine_rand(r);
+    r->state += seed;
+    engine_rand(r);
+}
+
+// This function returns the next 32 bits of r
+// The LCG state advances, and its high bits are xorshifted and rotated by its top 5 bits
+uint32_t engine_rand(struct rng *r)
+{
+    uint64_t old = r->state;
+    uint32_t x = ((old >> 18) ^ old) >> 27;
+    uint32_t rot = old >> 59;
+    r->state = old * PCG_MULT + r->inc;
+    return (x >> rot) | (x << ((-rot) & 31));
+}
+
+// This function rolls the hit points and power ups of both fighters
+void engine_start(struct fighter *f1, struct fighter *f2, struct rng *r)
+{
+    f1->hp = (engine_rand(r) % MAXHP) + 20; // Player 1's hit points
+    f2->hp = (engine_rand(r) % MAXHP) + 20; // Player 2's hit points
+    f1->pu = (engine_rand(r) % MAXPU) + 2; // Player 1's number of Power Ups
+    f2->pu = (engine_rand(r) % MAXPU) + 2; // Player 2's number of Power Ups
+}
+
+// This function applies a normal (a)ttack from atk to def
+// It returns the damage done
+int engine_attack(struct fighter *atk, struct fighter *def, struct rng *r)
+{
+    int admg = normaldmg(r);
+    def->hp -= admg;
+    return admg;
+}
+
+// This function applies a (p)owerup attack from atk to def
+// It returns the damage done (0 on a miss), or -1 if atk has no power ups left
+int engine_powerup(struct fighter *atk, struct fighter *def, struct rng *r)
+{
+    int pdmg;
+    if (atk->pu == 0)
+	return -1;
+    atk->pu--;
+    pdmg = powerdmg(r);
+    def->hp -= pdmg;
+    return pdmg;
+}
+
+// This function returns 1 if def has lost all its hit points
+int engine_over(const struct fighter *def)
+{
+    return def->hp <= 0;
+}
+
+// This function generates a normal damage
+int normaldmg(struct rng *r)
+{
+    return ((engine_rand(r) % MAXATK) + 2); // 2-6 dmg
+}
+
+// This function generates a powerup damage
+int powerdmg(struct rng *r)
+{
+    int dmg = normaldmg(r);
+    dmg *= 3; // triple the normal damage generated (6-18 dmg)
+    int acc = engine_rand(r) % 2; // 50 % accuracy
+    if (acc == 0)
+	return 0;
+    // acc == 1
+    return dmg;
+}
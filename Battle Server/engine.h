@@ -0,0 +1,41 @@
+// engine - the battle rules, with no I/O
+// The server formats and sends the messages, the engine only updates the fighters,
+// so the rules can be run (and timed) without sockets
+#ifndef ENGINE_H
+#define ENGINE_H
+
+#include <stdint.h>
+
+// For Combat
+#define MAXATK 4 // 2-6 damage (add 2 in code)
+#define MAXHP 11 // 20-30 hp (add 20 in code)
+#define MAXPU 3 // 2-4 PU (add 2 in code)
+
+// One side of a match
+struct fighter
+{
+    int hp; // number of hit points
+    int pu; // number of power ups
+};
+
+// A PCG32 generator: 64 bits of state, and an odd increment that picks one of 2^63 streams
+// Each match seeds its own (engine_seed()), so no roll touches shared state
+struct rng
+{
+    uint64_t state;
+    uint64_t inc;
+};
+
+//============================================
+// Function Prototypes
+//============================================
+void engine_seed(struct rng *r, uint64_t seed, uint64_t stream); // the same seed and stream give the same rolls
+uint32_t engine_rand(struct rng *r); // the next 32 random bits
+void engine_start(struct fighter *f1, struct fighter *f2, struct rng *r); // roll hp and pu for a new match
+int engine_attack(struct fighter *atk, struct fighter *def, struct rng *r); // returns the damage done
+int engine_powerup(struct fighter *atk, struct fighter *def, struct rng *r); // returns the damage done, -1 if no pu left
+int engine_over(const struct fighter *def); // returns 1 if def has lost
+int normaldmg(struct rng *r); // 2-6 damage
+int powerdmg(struct rng *r); // 3 x normaldmg(), 50% accuracy
+
+#endif
@@ -0,0 +1,67 @@
+// A log-linear histogram: values below HIST_SUB get a bucket each, above that
+// every power of two is split into HIST_SUB equal buckets.
+#include <stdio.h>
+#include "hist.h"
+
+// This function returns the bucket v falls in
+static int hist_index(uint64_t v)
+{
+    int e;
+    if (v < HIST_SUB)
+	return (int)v;
+    e = 63 - __builtin_clzll(v); // position of the highest set bit (>= 4)
+    // the top 5 bits of v (16-31) pick the sub-bucket
+    return (e - 3) * HIST_SUB + (int)((v >> (e - 4)) & (HIST_SUB - 1));
+}
+
+// This function returns the smallest value that falls in bucket i
+static uint64_t hist_value(int i)
+{
+    int e;
+    if (i < HIST_SUB)
+	return i;
+    e = i / HIST_SUB + 3;
+    return (uint64_t)(HIST_SUB + i % HIST_SUB) << (e - 4);
+}
+
+// This function records one sample
+void hist_add(struct hist *h, uint64_t v)
+{
+    h->count[hist_index(v)]++;
+    h->n++;
+    h->sum += v;
+    if (v > h->max)
+	h->max = v;
+}
+
+// This function adds every sample of from to to
+void hist_merge(struct hist *to, const struct hist *from)
+{
+    int i;
+    for (i = 0; i < HIST_BUCKETS; i++)
+	to->count[i] += from->count[i];
+    to->n += from->n;
+    to->sum += from->sum;
+    if (from->max > to->max)
+	to->max = from->max;
+}
+
+// This function returns the value at percentile pct (0-100)
+// It is the lower bound of the bucket the percentile falls in, capped by max
+uint64_t hist_pct(const struct hist *h, double pct)
+{
+    uint64_t want, seen = 0;
+    int i;
+    if (h->n == 0)
+	return 0;
+    want = (uint64_t)(pct / 100.0 * h->n + 0.5);
+    if (want < 1)
+	want = 1;
+    for (i = 0; i < HIST_BUCKETS; i++)
+    {
+	seen += h->count[i];
+	if (seen >= want)
+	    return hist_value(i) < h->max ? hist_value(i) : h->max;
+    }
+    return h->max;
+}
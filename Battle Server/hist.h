@@ -0,0 +1,26 @@
+// hist - log-linear latency histogram (HDR style)
+// Recording is an array increment, no allocation and no system call
+#ifndef HIST_H
+#define HIST_H
+
+#include <stdint.h>
+
+#define HIST_SUB 16 // sub-buckets per power of two, values are kept within ~6%
+#define HIST_BUCKETS (61 * HIST_SUB) // enough for any uint64_t
+
+struct hist
+{
+    uint64_t count[HIST_BUCKETS]; // samples per bucket
+    uint64_t n; // number of samples
+    uint64_t sum; // sum of samples, for the mean
+    uint64_t max; // largest sample
+};
+
+//============================================
+// Function Prototypes
+//============================================
+void hist_add(struct hist *h, uint64_t v); // record one sample
+void hist_merge(struct hist *to, const struct hist *from); // add every sample of from to to
+uint64_t hist_pct(const struct hist *h, double pct); // value at percentile pct (0-100)
+
+#endif
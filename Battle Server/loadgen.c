@@ -0,0 +1,418 @@
+// loadgen - drives many simulated players against the battleserver
+// Every connection names itself and plays (a)ttack, (p)owermove or (y)ell on its turn,
+// following the same text protocol a telnet user sees.
+//
+// >> ./loadgen -n 2000 -d 30
+// reports connect latency, turn round trip percentiles, matches completed per second and errors
+//
+// With -I the connections name themselves and then sit idle; given the server's pid (-P),
+// the growth of its resident memory is divided by the connections it holds at the end:
+// >> ./loadgen -I -P $(pidof battleserver) -a 8 -n 100000 -d 20
+#ifndef PORT
+    #define PORT 30130 // in case use gcc instead of makefile
+#endif
+//============================================
+// Header Files
+//============================================
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include "hist.h"
+
+//============================================
+// Globals
+//============================================
+#define MAXIN 4096 // input buffered per connection
+#define MAXEVENTS 256
+#define CONNBATCH 64 // connections opened per loop iteration
+
+// Connection states
+#define CONNECTING 0 // waiting for connect() to finish
+#define NAMING 1 // waiting for the greeting
+#define PLAYING 2 // named, in the lobby or in a match
+
+// One simulated player
+struct conn
+{
+    int fd; // -1 if not connected
+    int id; // index in conns[], used for the name
+    int state; // CONNECTING, NAMING or PLAYING
+    char in[MAXIN]; // bytes received but not yet a full line
+    int inlen; // bytes in in
+    int options; // 1 if the last line was "Here are your list of options,"
+    uint64_t tstart; // when connect() was called
+    uint64_t tsent; // when the last move was sent, 0 if none is outstanding
+    int matches; // matches finished on this connection
+};
+
+static struct conn *conns; // all simulated players
+static int nconns = 100; // -n
+static int duration = 10; // -d seconds
+static int churn = 0; // -m: reconnect after this many matches, 0 = never
+static int yellpct = 0; // -y: percent of turns that yell before attacking
+static struct sockaddr_in server;
+static int epfd;
+static unsigned int seed = 1; // -s
+static int idle = 0; // -I: name, then never play
+static int serverpid = 0; // -P: the server whose memory is measured
+static int naddrs = 1; // -a: connections are spread over this many addresses from host
+static long rssbefore; // the server's resident kB before connecting
+
+// Results
+static struct hist connlat; // connect latency (us)
+static struct hist turnlat; // move sent to "Waiting for opponent's next move" (us)
+static long nconnected, nconnfail, nmatches, nwins, nturns, nerrors, nclosed;
+
+// Messages (must match battleserver.c)
+static char greeting[] = "Please enter your name";
+static char options[] = "Here are your list of options,";
+static char waitmoves[] = "Waiting for opponent's next move";
+static char winner[] = "Congratulations! You have won!";
+static char loser[] = "Unfortunately, you have lost.";
+
+//============================================
+// Function Prototypes
+//============================================
+static uint64_t now(void); // microseconds
+static void start(struct conn *c); // open a connection
+static void finish(struct conn *c, int error); // close a connection
+static void sendline(struct conn *c, const char *s); // send s and \r\n
+static void readable(struct conn *c); // read and handle whole lines
+static void handle(struct conn *c, char *line); // handle one line from the server
+static void report(double secs); // print the results
+static long readrss(int pid); // resident kB of process pid, -1 if unknown
+static void usage(char *prog);
+
+//============================================
+// Main Function
+//============================================
+
+int main(int argc, char **argv)
+{
+    struct epoll_event ev[MAXEVENTS];
+    struct rlimit rl;
+    char *host = "127.0.0.1";
+    int port = PORT, c, i, n, next = 0;
+    uint64_t t0, end;
+    while ((c = getopt(argc, argv, "h:p:n:d:m:y:s:IP:a:")) != -1)
+    {
+	switch (c)
+	{
+	case 'h': host = optarg; break;
+	case 'p': port = atoi(optarg); break;
+	case 'n': nconns = atoi(optarg); break;
+	case 'd': duration = atoi(optarg); break;
+	case 'm': churn = atoi(optarg); break;
+	case 'y': yellpct = atoi(optarg); break;
+	case 's': seed = strtoul(optarg, NULL, 10); break;
+	case 'I': idle = 1; break;
+	case 'P': serverpid = atoi(optarg); break;
+	case 'a': naddrs = atoi(optarg); break;
+	default: usage(argv[0]);
+	}
+    }
+    if (nconns < 1 || duration < 1 || naddrs < 1)
+	usage(argv[0]);
+    (void)signal(SIGPIPE, SIG_IGN);
+    // Allow as many descriptors as we can
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0)
+    {
+	rl.rlim_cur = rl.rlim_max;
+	setrlimit(RLIMIT_NOFILE, &rl);
+	if (rl.rlim_cur < (rlim_t)nconns + 16)
+	    fprintf(stderr, "warning: only %ld descriptors available\n", (long)rl.rlim_cur);
+    }
+    memset(&server, 0, sizeof(server));
+    server.sin_family = AF_INET;
+    server.sin_port = htons(port);
+    if (inet_pton(AF_INET, host, &server.sin_addr) != 1)
+    {
+	fprintf(stderr, "bad address %s\n", host);
+	exit(1);
+    }
+    if ((epfd = epoll_create1(0)) < 0)
+    {
+	perror("epoll_create1");
+	exit(1);
+    }
+    if (!(conns = calloc(nconns, sizeof(struct conn))))
+    {
+	fprintf(stderr, "out of memory!\n");
+	exit(1);
+    }
+    for (i = 0; i < nconns; i++)
+    {
+	conns[i].id = i;
+	conns[i].fd = -1;
+    }
+    if (serverpid)
+	rssbefore = readrss(serverpid);
+    t0 = now();
+    end = t0 + (uint64_t)duration * 1000000;
+    while (now() < end)
+    {
+	// Ramp up (and replace closed connections) a batch at a time
+	for (i = 0, n = 0; i < nconns && n < CONNBATCH; i++, next = (next + 1) % nconns)
+	{
+	    if (conns[next].fd < 0)
+	    {
+		start(&conns[next]);
+		n++;
+	    }
+	}
+	if ((n = epoll_wait(epfd, ev, MAXEVENTS, 100)) < 0)
+	{
+	    if (errno == EINTR)
+		continue;
+	    perror("epoll_wait");
+	    exit(1);
+	}
+	for (i = 0; i < n; i++)
+	{
+	    struct conn *cn = &conns[ev[i].data.u32];
+	    if (cn->fd < 0)
+		continue;
+	    if (cn->state == CONNECTING)
+	    {
+		int err = 0;
+		socklen_t len = sizeof(err);
+		getsockopt(cn->fd, SOL_SOCKET, SO_ERROR, &err, &len);
+		if (err)
+		{
+		    nconnfail++;
+		    finish(cn, 0);
+		    continue;
+		}
+		hist_add(&connlat, now() - cn->tstart);
+		nconnected++;
+		cn->state = NAMING;
+		struct epoll_event e = { EPOLLIN, { .u32 = cn->id } };
+		epoll_ctl(epfd, EPOLL_CTL_MOD, cn->fd, &e);
+		continue;
+	    }
+	    readable(cn);
+	}
+    }
+    report((now() - t0) / 1e6);
+    return 0;
+}
+
+//============================================
+// Helper Functions
+//============================================
+
+// This function returns the current time in microseconds
+static uint64_t now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// This function opens a non-blocking connection for c
+static void start(struct conn *c)
+{
+    struct sockaddr_in to = server;
+    int on = 1;
+    if ((c->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0)) < 0)
+    {
+	nconnfail++;
+	return;
+    }
+    setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on)); // moves are tiny
+    c->state = CONNECTING;
+    c->inlen = 0;
+    c->options = 0;
+    c->tsent = 0;
+    c->matches = 0;
+    c->tstart = now();
+    // Each address has its own ephemeral ports, so -a lifts the limit of ~28000 connections
+    to.sin_addr.s_addr = htonl(ntohl(server.sin_addr.s_addr) + c->id % naddrs);
+    if (connect(c->fd, (struct sockaddr *)&to, sizeof(to)) < 0 && errno != EINPROGRESS)
+    {
+	nconnfail++;
+	close(c->fd);
+	c->fd = -1;
+	return;
+    }
+    struct epoll_event e = { EPOLLOUT, { .u32 = c->id } };
+    epoll_ctl(epfd, EPOLL_CTL_ADD, c->fd, &e);
+}
+
+// This function closes c's connection, counting an error if it was unexpected
+static void finish(struct conn *c, int error)
+{
+    if (error)
+	nerrors++;
+    close(c->fd); // also removes it from epoll
+    c->fd = -1;
+}
+
+// This function sends s followed by \r\n
+static void sendline(struct conn *c, const char *s)
+{
+    char buf[MAXIN];
+    int len = snprintf(buf, sizeof(buf), "%s\r\n", s);
+    if (write(c->fd, buf, len) != len)
+	finish(c, 1); // the server never lets a player's socket buffer fill up
+}
+
+// This function reads what is available and handles every complete line
+static void readable(struct conn *c)
+{
+    ssize_t n;
+    char *line, *nl;
+    if ((n = read(c->fd, c->in + c->inlen, MAXIN - 1 - c->inlen)) <= 0)
+    {
+	if (n < 0 && errno == EAGAIN)
+	    return;
+	nclosed++;
+	finish(c, 1); // the server closed on us
+	return;
+    }
+    c->inlen += n;
+    c->in[c->inlen] = '\0';
+    line = c->in;
+    while (c->fd >= 0 && (nl = strchr(line, '\n')))
+    {
+	*nl = '\0';
+	if (nl > line && nl[-1] == '\r')
+	    nl[-1] = '\0';
+	handle(c, line);
+	line = nl + 1;
+    }
+    if (c->fd < 0)
+	return;
+    // Keep the partial line for the next read
+    c->inlen -= line - c->in;
+    memmove(c->in, line, c->inlen);
+    if (c->inlen == MAXIN - 1) // no newline in a full buffer, the server would never send that
+    {
+	finish(c, 1);
+	return;
+    }
+}
+
+// This function handles one line from the server
+static void handle(struct conn *c, char *line)
+{
+    char name[32];
+    if (c->state == NAMING)
+    {
+	if (strstr(line, greeting))
+	{
+	    snprintf(name, sizeof(name), "bot%d", c->id);
+	    sendline(c, name);
+	    c->state = PLAYING;
+	}
+	return;
+    }
+    if (idle)
+	return; // output is read and ignored
+    if (c->options) // the line after "Here are your list of options," says which moves we have
+    {
+	c->options = 0;
+	if (yellpct && (int)(rand_r(&seed) % 100) < yellpct)
+	{
+	    sendline(c, "y");
+	    if (c->fd >= 0)
+		sendline(c, "good luck");
+	}
+	if (c->fd < 0)
+	    return;
+	sendline(c, (strstr(line, "(p)owermove") && (rand_r(&seed) & 1)) ? "p" : "a");
+	c->tsent = now();
+	return;
+    }
+    if (strstr(line, options))
+	c->options = 1;
+    else if (c->tsent && strstr(line, waitmoves)) // our move went through
+    {
+	hist_add(&turnlat, now() - c->tsent);
+	c->tsent = 0;
+	nturns++;
+    }
+    else if (strstr(line, winner) || strstr(line, loser))
+    {
+	c->tsent = 0;
+	if (line[0] == 'C')
+	{
+	    nwins++; // every match has exactly one winner
+	    nmatches++;
+	}
+	if (churn && ++c->matches >= churn)
+	    finish(c, 0); // reconnected on the next loop
+    }
+}
+
+// This function prints the results
+static void report(double secs)
+{
+    long rss, held = 0;
+    int i;
+    if (idle)
+    {
+	for (i = 0; i < nconns; i++)
+	    held += conns[i].fd >= 0 && conns[i].state == PLAYING;
+	printf("duration: %.1f s, idle connections: %ld of %d\n", secs, held, nconns);
+	printf("connects: %ld ok, %ld failed, errors: %ld\n", nconnected, nconnfail, nerrors);
+	if (serverpid && (rss = readrss(serverpid)) >= 0 && rssbefore >= 0 && held)
+	    printf("server rss: %ld kB before, %ld kB after, %ld bytes per idle connection\n",
+		    rssbefore, rss, (rss - rssbefore) * 1024 / held);
+	return;
+    }
+    printf("duration: %.1f s, connections: %d\n", secs, nconns);
+    printf("connects: %ld ok, %ld failed\n", nconnected, nconnfail);
+    printf("connect latency (us): p50 %lu p90 %lu p99 %lu max %lu\n",
+	    (unsigned long)hist_pct(&connlat, 50), (unsigned long)hist_pct(&connlat, 90),
+	    (unsigned long)hist_pct(&connlat, 99), (unsigned long)connlat.max);
+    printf("turns: %ld (%.0f/s)\n", nturns, nturns / secs);
+    printf("turn round trip (us): p50 %lu p90 %lu p99 %lu p99.9 %lu max %lu\n",
+	    (unsigned long)hist_pct(&turnlat, 50), (unsigned long)hist_pct(&turnlat, 90),
+	    (unsigned long)hist_pct(&turnlat, 99), (unsigned long)hist_pct(&turnlat, 99.9),
+	    (unsigned long)turnlat.max);
+    printf("matches completed: %ld (%.1f/s)\n", nmatches, nmatches / secs);
+    printf("errors: %ld (%ld closed by server)\n", nerrors, nclosed);
+}
+
+// This function returns the resident memory of process pid in kB, or -1 if it can't be read
+static long readrss(int pid)
+{
+    char path[64], line[256];
+    long kb = -1;
+    FILE *f;
+    snprintf(path, sizeof(path), "/proc/%d/status", pid);
+    if (!(f = fopen(path, "r")))
+	return -1;
+    while (fgets(line, sizeof(line), f))
+    {
+	if (sscanf(line, "VmRSS: %ld", &kb) == 1)
+	    break;
+    }
+    fclose(f);
+    return kb;
+}
+
+// This function prints the command line options and exits
+static void usage(char *prog)
+{
+    fprintf(stderr, "usage: %s [-h host] [-p port] [-n connections] [-d seconds] [-m matches] [-y percent] [-s seed] [-I] [-P pid] [-a addrs]\n", prog);
+    fprintf(stderr, "  -m matches  disconnect and reconnect after this many matches (default never)\n");
+    fprintf(stderr, "  -y percent  yell before this percent of moves (default 0)\n");
+    fprintf(stderr, "  -I  name each connection, then leave it idle\n");
+    fprintf(stderr, "  -P pid  with -I, report the growth of pid's resident memory per idle connection\n");
+    fprintf(stderr, "  -a addrs  spread connections over addrs consecutive addresses from host (default 1)\n");
+    exit(1);
+}
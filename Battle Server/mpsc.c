@@ -0,0 +1,34 @@
+// A lock-free queue for handing work between battleserver shards
+// Pushing only ever CASes the head, and popping swaps the whole stack out,
+// so there is no ABA problem and no node is freed while another thread reads it.
+#include <stdio.h>
+#include "mpsc.h"
+
+// This function pushes n onto q
+// It returns 1 if q was empty, so the caller knows the consumer needs a wakeup
+int mpsc_push(struct mpsc *q, struct mpsc_node *n)
+{
+    struct mpsc_node *old = atomic_load_explicit(&q->head, memory_order_relaxed);
+    do
+    {
+	n->next = old; // link on top of what is there now
+    } while (!atomic_compare_exchange_weak_explicit(&q->head, &old, n,
+		memory_order_release, memory_order_relaxed));
+    return old == NULL;
+}
+
+// This function takes every node off q
+// It returns them oldest first (the order they were pushed), NULL if q was empty
+struct mpsc_node *mpsc_popall(struct mpsc *q)
+{
+    struct mpsc_node *n, *next, *rev = NULL;
+    n = atomic_exchange_explicit(&q->head, NULL, memory_order_acquire);
+    while (n) // reverse newest-first into oldest-first
+    {
+	next = n->next;
+	n->next = rev;
+	rev = n;
+	n = next;
+    }
+    return rev;
+}
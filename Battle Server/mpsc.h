@@ -0,0 +1,27 @@
+// mpsc - lock-free multi-producer, single-consumer queue
+// Any thread may push, only the owning thread pops (all at once)
+#ifndef MPSC_H
+#define MPSC_H
+
+#include <stdatomic.h>
+
+// Embed this as the first member of anything that is queued
+struct mpsc_node
+{
+    struct mpsc_node *next; // the node pushed before this one (newer to older)
+};
+
+// The queue is a Treiber stack: producers CAS onto the head,
+// the consumer swaps the whole stack out and reverses it
+struct mpsc
+{
+    _Atomic(struct mpsc_node *) head; // the newest node, NULL if empty
+};
+
+//============================================
+// Function Prototypes
+//============================================
+int mpsc_push(struct mpsc *q, struct mpsc_node *n); // returns 1 if q was empty (wake the consumer)
+struct mpsc_node *mpsc_popall(struct mpsc *q); // returns every queued node, oldest first
+
+#endif
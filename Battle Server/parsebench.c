@@ -0,0 +1,224 @@
+// parsebench - times the input framing (ring.c) on synthetic client streams
+// and compares it with the strtok()/memmove() framing extractline() and cleanup() used to do
+//
+// >> make bench
+// >> ./parsebench -m 64 -s 42
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include "ring.h"
+
+#define MB 64 // default stream size in megabytes
+#define MAXBUF 300 // the old per-client buffer
+#define MAXMSG 128 // line cap, as in battleserver.c
+
+// The kinds of stream
+#define CMDS 0 // a, p and y only
+#define CHAT 1 // mostly yelled messages
+#define MIXED 2 // commands with a message now and then
+
+static const char *streamname[] = { "commands", "chat", "mixed" };
+
+// What a framer found, to check that both agree
+struct result
+{
+    long lines; // lines framed
+    long bytes; // bytes in those lines
+};
+
+// This function returns the current time in seconds
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// This function fills s with size bytes of client input of the given kind
+static void makestream(char *s, size_t size, int kind, unsigned int seed)
+{
+    static const char *cmds[] = { "a", "p", "y" };
+    static const char *eol[] = { "\r\n", "\n", "\r\n", "\r\n" }; // telnet sends \r\n, nc sends \n
+    size_t len = 0;
+    int i, n;
+    char line[MAXMSG + 3];
+    while (len < size)
+    {
+	if (kind == CMDS || (kind == MIXED && rand_r(&seed) % 8))
+	    n = sprintf(line, "%s", cmds[rand_r(&seed) % 3]);
+	else
+	{
+	    n = 1 + rand_r(&seed) % (MAXMSG - 8);
+	    for (i = 0; i < n; i++)
+		line[i] = rand_r(&seed) % 6 ? 'a' + rand_r(&seed) % 26 : ' ';
+	    line[n] = '\0';
+	}
+	n += sprintf(line + n, "%s", eol[rand_r(&seed) % 4]);
+	if (len + n > size)
+	    n = size - len;
+	memcpy(s + len, line, n);
+	len += n;
+    }
+    s[size - 1] = '\n'; // the last line is complete
+}
+
+//============================================
+// The old framing
+//============================================
+
+// This function frames stream the way the server did before the ring buffer:
+// each read fills a linear buffer, strtok() finds the first line from buf[0],
+// and the rest is memmove()d down to buf[0] before the next line
+static struct result oldframe(const char *stream, size_t size, size_t readsize)
+{
+    struct result res = { 0, 0 };
+    char buf[MAXBUF + 1];
+    size_t have = 0, pos = 0, n, len;
+    char *tok;
+    while (pos < size || have)
+    {
+	// read()
+	n = MAXBUF - have;
+	if (n > readsize)
+	    n = readsize;
+	if (n > size - pos)
+	    n = size - pos;
+	memcpy(buf + have, stream + pos, n);
+	pos += n;
+	have += n;
+	buf[have] = '\0';
+	while (1)
+	{
+	    // extractline()
+	    if (!(tok = strtok(buf, "\r\n")))
+	    {
+		have = 0; // only delimiters left
+		break;
+	    }
+	    len = strlen(tok);
+	    if (tok + len == buf + have && pos < size)
+		break; // no delimiter after it yet, wait for the next read
+	    res.lines++;
+	    res.bytes += len;
+	    // cleanup()
+	    n = tok + len - buf;
+	    if (n < have)
+		n++; // the delimiter strtok() overwrote
+	    memmove(buf, buf + n, have - n);
+	    have -= n;
+	    buf[have] = '\0';
+	}
+	if (have == MAXBUF)
+	    have = 0; // can't happen with lines under MAXMSG
+    }
+    return res;
+}
+
+//============================================
+// The ring buffer
+//============================================
+
+// This function frames stream with ring_line(), each read filling the ring's free space
+static struct result ringframe(const char *stream, size_t size, size_t readsize)
+{
+    struct result res = { 0, 0 };
+    struct ring r;
+    struct iovec iov[2];
+    char scratch[MAXMSG + 1];
+    size_t pos = 0, n, want;
+    int i, cnt;
+    char *s;
+    ring_init(&r);
+    while (pos < size)
+    {
+	// readv()
+	cnt = ring_space(&r, iov);
+	want = size - pos < readsize ? size - pos : readsize;
+	for (i = 0, n = 0; i < cnt && n < want; i++)
+	{
+	    size_t k = iov[i].iov_len < want - n ? iov[i].iov_len : want - n;
+	    memcpy(iov[i].iov_base, stream + pos + n, k);
+	    n += k;
+	}
+	pos += n;
+	ring_fill(&r, n);
+	while ((s = ring_line(&r, scratch, MAXMSG)))
+	{
+	    res.lines++;
+	    res.bytes += strlen(s);
+	}
+    }
+    return res;
+}
+
+// This function prints the command line options and exits
+static void usage(char *prog)
+{
+    fprintf(stderr, "usage: %s [-m megabytes] [-r readsize] [-s seed]\n", prog);
+    fprintf(stderr, "  -r readsize  most bytes one read() returns (default %d)\n", RINGSIZE);
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    static const char *scan[] = { "scalar", "sse2", "avx2" };
+    size_t size = (size_t)MB << 20, readsize = RINGSIZE;
+    unsigned int seed = 1;
+    struct result old, res;
+    double t, secs;
+    char *stream;
+    int c, kind, i;
+    while ((c = getopt(argc, argv, "m:r:s:")) != -1)
+    {
+	switch (c)
+	{
+	case 'm':
+	    size = (size_t)atol(optarg) << 20;
+	    break;
+	case 'r':
+	    readsize = atol(optarg);
+	    break;
+	case 's':
+	    seed = strtoul(optarg, NULL, 10);
+	    break;
+	default:
+	    usage(argv[0]);
+	}
+    }
+    if (size == 0 || readsize == 0)
+	usage(argv[0]);
+    if (!(stream = malloc(size)))
+    {
+	fprintf(stderr, "out of memory!\n");
+	exit(1);
+    }
+    printf("stream: %lu MB, reads of up to %lu bytes\n", (unsigned long)(size >> 20), (unsigned long)readsize);
+    for (kind = CMDS; kind <= MIXED; kind++)
+    {
+	makestream(stream, size, kind, seed);
+	t = now();
+	old = oldframe(stream, size, readsize);
+	secs = now() - t;
+	printf("%-8s %-20s %6.2f GB/s %8.1f Mlines/s\n", streamname[kind], "extractline()",
+		size / secs / 1e9, old.lines / secs / 1e6);
+	for (i = 0; i < 3; i++)
+	{
+	    char name[32];
+	    if (ring_setscanner(scan[i]) < 0)
+		continue; // this CPU can't run it
+	    t = now();
+	    res = ringframe(stream, size, readsize);
+	    secs = now() - t;
+	    snprintf(name, sizeof(name), "ring_line() %s", scan[i]);
+	    printf("%-8s %-20s %6.2f GB/s %8.1f Mlines/s%s\n", streamname[kind], name,
+		    size / secs / 1e9, res.lines / secs / 1e6,
+		    (res.lines == old.lines && res.bytes == old.bytes) ? "" : "  MISMATCH");
+	}
+    }
+    ring_setscanner(NULL);
+    printf("the server uses: %s\n", ring_scanner());
+    free(stream);
+    return 0;
+}
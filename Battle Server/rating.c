@@ -0,0 +1,90 @@
+// Ratings for the battleserver's matchmaking
+// The Elo expected score needs 10^x, so the points a win is worth are tabled by the
+// rating gap instead (in steps of 25 points, 32 for an even match), and nothing needs libm.
+#include "rating.h"
+
+#define GAPSTEPS 32 // gaps of 800 points or more count as 800
+
+// Points the winner takes from the loser, by (loser - winner) / 25 + GAPSTEPS:
+// round(32 / (1 + 10^(-gap / 400)))
+static const unsigned char gain[2 * GAPSTEPS + 1] =
+{
+    0, 0, 0, 0, 1, 1, 1, 1, 1, 1, 1, 1, 2, 2, 2, 3, 3, 3, 4, 4, 5, 5,
+    6, 7, 8, 9, 9, 10, 12, 13, 14, 15, 16, 17, 18, 19, 20, 22, 23, 23, 24, 25,
+    26, 27, 27, 28, 28, 29, 29, 29, 30, 30, 30, 31, 31, 31, 31, 31, 31, 31, 31, 32,
+    32, 32, 32
+};
+
+// This function moves the ratings of a battle's winner and loser
+void rating_update(int *winner, int *loser)
+{
+    int step = (*loser - *winner) / 25;
+    int d;
+    if (step < -GAPSTEPS)
+	step = -GAPSTEPS;
+    if (step > GAPSTEPS)
+	step = GAPSTEPS;
+    d = gain[step + GAPSTEPS];
+    *winner += d;
+    *loser -= d;
+    if (*winner >= RATINGMAX)
+	*winner = RATINGMAX - 1;
+    if (*loser < 0)
+	*loser = 0;
+}
+
+// This function returns the bucket rating falls in
+int rating_bucket(int rating)
+{
+    if (rating < 0)
+	return 0;
+    if (rating >= RATINGMAX)
+	return NBUCKETS - 1;
+    return rating / BUCKETW;
+}
+
+// This function marks bucket b as having players
+void ladder_set(struct ladder *l, int b)
+{
+    l->used[b >> 6] |= 1ULL << (b & 63);
+}
+
+// This function marks bucket b as empty
+void ladder_clear(struct ladder *l, int b)
+{
+    l->used[b >> 6] &= ~(1ULL << (b & 63));
+}
+
+// This function returns the first occupied bucket after b, or -1 if there is none
+int ladder_above(const struct ladder *l, int b)
+{
+    int w = ++b >> 6;
+    uint64_t bits;
+    if (b >= NBUCKETS)
+	return -1;
+    bits = l->used[w] & (~0ULL << (b & 63)); // b and the buckets after it in its word
+    while (!bits)
+    {
+	if (++w == LADDERWORDS)
+	    return -1;
+	bits = l->used[w];
+    }
+    return (w << 6) + __builtin_ctzll(bits);
+}
+
+// This function returns the last occupied bucket before b, or -1 if there is none
+int ladder_below(const struct ladder *l, int b)
+{
+    int w = --b >> 6;
+    uint64_t bits;
+    if (b < 0)
+	return -1;
+    bits = l->used[w] & (~0ULL >> (63 - (b & 63))); // b and the buckets before it in its word
+    while (!bits)
+    {
+	if (--w < 0)
+	    return -1;
+	bits = l->used[w];
+    }
+    return (w << 6) + 63 - __builtin_clzll(bits);
+}
@@ -0,0 +1,33 @@
+// rating - Elo ratings and the rating buckets players wait in
+// A player's rating moves by the Elo rule after every battle it finishes. Waiting players
+// are kept in buckets BUCKETW rating points wide, and a bitmap of the buckets that are not
+// empty finds the nearest occupied bucket on either side with a few word operations,
+// however many players are waiting.
+#ifndef RATING_H
+#define RATING_H
+
+#include <stdint.h>
+
+#define RATING0 1500 // a new player's rating
+#define RATINGMAX 4000 // ratings are kept in [0, RATINGMAX)
+#define BUCKETW 25 // rating points per bucket
+#define NBUCKETS (RATINGMAX / BUCKETW)
+#define LADDERWORDS ((NBUCKETS + 63) / 64)
+
+// Which buckets have players in them
+struct ladder
+{
+    uint64_t used[LADDERWORDS]; // bit b set if bucket b is not empty
+};
+
+//============================================
+// Function Prototypes
+//============================================
+void rating_update(int *winner, int *loser); // apply the result of one battle
+int rating_bucket(int rating); // the bucket a rating falls in
+void ladder_set(struct ladder *l, int b); // bucket b has players
+void ladder_clear(struct ladder *l, int b); // bucket b is empty
+int ladder_above(const struct ladder *l, int b); // the first occupied bucket after b, -1 if none
+int ladder_below(const struct ladder *l, int b); // the last occupied bucket before b, -1 if none
+
+#endif
@@ -0,0 +1,194 @@
+// A wrapper for epoll() with a select() fallback
+// Descriptors are registered once when a client arrives and removed when it leaves,
+// so each wakeup only touches the descriptors that are actually ready.
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include "reactor.h"
+
+#if defined(__linux__) && !defined(USE_SELECT)
+//============================================
+// epoll backend
+//============================================
+#include <sys/epoll.h>
+
+static __thread int epfd = -1; // the epoll instance (one per shard thread)
+
+// This function converts RE_* flags to epoll flags
+static unsigned int toepoll(int events)
+{
+    unsigned int e = 0;
+    if (events & RE_READ)
+	e |= EPOLLIN;
+    if (events & RE_WRITE)
+	e |= EPOLLOUT;
+    if (events & RE_EDGE)
+	e |= EPOLLET;
+    return e;
+}
+
+// This function creates the epoll instance
+int reactor_init(void)
+{
+    if ((epfd = epoll_create1(EPOLL_CLOEXEC)) < 0)
+    {
+	perror("epoll_create1");
+	return -1;
+    }
+    return 0;
+}
+
+// This function registers fd with the epoll instance
+int reactor_add(int fd, int events)
+{
+    struct epoll_event e;
+    memset(&e, 0, sizeof(e));
+    e.events = toepoll(events);
+    e.data.fd = fd;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &e) < 0)
+    {
+	perror("epoll_ctl add");
+	return -1;
+    }
+    return 0;
+}
+
+// This function changes the events fd is registered for
+int reactor_mod(int fd, int events)
+{
+    struct epoll_event e;
+    memset(&e, 0, sizeof(e));
+    e.events = toepoll(events);
+    e.data.fd = fd;
+    if (epoll_ctl(epfd, EPOLL_CTL_MOD, fd, &e) < 0)
+    {
+	perror("epoll_ctl mod");
+	return -1;
+    }
+    return 0;
+}
+
+// This function removes fd from the epoll instance
+int reactor_del(int fd)
+{
+    struct epoll_event e; // ignored, but kernels before 2.6.9 require non-NULL
+    if (epoll_ctl(epfd, EPOLL_CTL_DEL, fd, &e) < 0)
+    {
+	perror("epoll_ctl del");
+	return -1;
+    }
+    return 0;
+}
+
+// This function waits for events and fills ev with at most maxev ready descriptors
+// It returns the number of ready descriptors, 0 on timeout or signal, -1 on error
+int reactor_wait(struct revent *ev, int maxev, int timeout)
+{
+    struct epoll_event e[maxev];
+    int i, n;
+    if ((n = epoll_wait(epfd, e, maxev, timeout)) < 0)
+    {
+	if (errno == EINTR) // interrupted by a signal, nothing is ready
+	    return 0;
+	perror("epoll_wait");
+	return -1;
+    }
+    for (i = 0; i < n; i++)
+    {
+	ev[i].fd = e[i].data.fd;
+	ev[i].events = 0;
+	// Errors and hangups are reported as readable so the next read() sees them
+	if (e[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP))
+	    ev[i].events |= RE_READ;
+	if (e[i].events & EPOLLOUT)
+	    ev[i].events |= RE_WRITE;
+    }
+    return n;
+}
+
+#else
+//============================================
+// select backend
+//============================================
+static __thread fd_set rset, wset; // the descriptors being watched (one per shard thread)
+static __thread int maxfd = -1; // highest descriptor being watched
+
+// This function clears the watched sets
+int reactor_init(void)
+{
+    FD_ZERO(&rset);
+    FD_ZERO(&wset);
+    maxfd = -1;
+    return 0;
+}
+
+// This function starts watching fd
+int reactor_add(int fd, int events)
+{
+    if (fd >= FD_SETSIZE)
+    {
+	fprintf(stderr, "fd %d exceeds FD_SETSIZE\n", fd);
+	return -1;
+    }
+    return reactor_mod(fd, events);
+}
+
+// This function changes the events fd is watched for
+int reactor_mod(int fd, int events)
+{
+    FD_CLR(fd, &rset);
+    FD_CLR(fd, &wset);
+    if (events & RE_READ)
+	FD_SET(fd, &rset);
+    if (events & RE_WRITE)
+	FD_SET(fd, &wset);
+    if (fd > maxfd)
+	maxfd = fd;
+    return 0;
+}
+
+// This function stops watching fd
+int reactor_del(int fd)
+{
+    FD_CLR(fd, &rset);
+    FD_CLR(fd, &wset);
+    while (maxfd >= 0 && !FD_ISSET(maxfd, &rset) && !FD_ISSET(maxfd, &wset))
+	maxfd--; // shrink maxfd to the next watched descriptor
+    return 0;
+}
+
+// This function waits for events and fills ev with at most maxev ready descriptors
+int reactor_wait(struct revent *ev, int maxev, int timeout)
+{
+    fd_set r = rset, w = wset; // select() overwrites its arguments
+    struct timeval tv, *tp = NULL;
+    int fd, n, i = 0;
+    if (timeout >= 0)
+    {
+	tv.tv_sec = timeout / 1000;
+	tv.tv_usec = (timeout % 1000) * 1000;
+	tp = &tv;
+    }
+    if ((n = select(maxfd + 1, &r, &w, NULL, tp)) < 0)
+    {
+	if (errno == EINTR)
+	    return 0;
+	perror("select");
+	return -1;
+    }
+    for (fd = 0; fd <= maxfd && i < n && i < maxev; fd++)
+    {
+	ev[i].events = 0;
+	if (FD_ISSET(fd, &r))
+	    ev[i].events |= RE_READ;
+	if (FD_ISSET(fd, &w))
+	    ev[i].events |= RE_WRITE;
+	if (ev[i].events)
+	    ev[i++].fd = fd;
+    }
+    return i;
+}
+#endif
@@ -0,0 +1,30 @@
+// reactor - readiness notification for the battleserver
+// epoll(7) on Linux, select(2) everywhere else (or with -DUSE_SELECT)
+// Each thread that calls reactor_init() gets its own reactor
+#ifndef REACTOR_H
+#define REACTOR_H
+
+//===============
+// Event Flags
+//===============
+#define RE_READ  0x1 // fd is readable (or a peer is waiting in accept())
+#define RE_WRITE 0x2 // fd is writable
+#define RE_EDGE  0x4 // edge-triggered, caller must drain until EAGAIN (epoll only)
+
+// One ready descriptor returned by reactor_wait()
+struct revent
+{
+    int fd; // the ready file descriptor
+    int events; // RE_READ and/or RE_WRITE
+};
+
+//============================================
+// Function Prototypes
+//============================================
+int reactor_init(void); // create the reactor, returns -1 on error
+int reactor_add(int fd, int events); // start watching fd, registered once per connection
+int reactor_mod(int fd, int events); // change the events watched on fd
+int reactor_del(int fd); // stop watching fd, call before close()
+int reactor_wait(struct revent *ev, int maxev, int timeout); // timeout in ms, -1 blocks forever
+
+#endif
@@ -3,6 +3,7 @@
 #include <unistd.h>
 #include <sys/types.h>
 #include <errno.h>
+#include <sys/uio.h> // readv()
 
 // Read "n" bytes from a descriptor.
 ssize_t readn(int fd, void *vptr, size_t n)
@@ -33,8 +34,22 @@ ssize_t Readn(int fd, void *ptr, size_t nbytes)
     ssize_t n;
     if ((n = readn(fd, ptr, nbytes)) < 0)
     {
-        perror("readn error");
+        if (errno != EAGAIN && errno != EWOULDBLOCK) // nothing to read yet on a non-blocking fd
+            perror("readn error");
         return (-1);
     }
     return(n);
 }
+
+// This function reads from fd into iovcnt buffers
+ssize_t Readv(int fd, const struct iovec *iov, int iovcnt)
+{
+    ssize_t n;
+    if ((n = readv(fd, iov, iovcnt)) < 0)
+    {
+        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) // nothing to read yet, or interrupted
+            perror("readv error");
+        return (-1);
+    }
+    return (n);
+}
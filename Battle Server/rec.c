@@ -0,0 +1,292 @@
+// Traffic recording for the battleserver
+// Records are only ever appended by the thread that made them, into its own buffer;
+// rec_flush() writes the buffer out under a lock, once per loop iteration.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include "rec.h"
+
+#define MAGIC "BSREC"
+#define VERSION 1
+#define RECBUF 65536 // a thread's buffer, flushed early when it fills up
+#define MAXVARINT 10 // bytes in the longest varint
+
+static int recfd = -1; // the recording, -1 if not recording
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER; // one block is written at a time
+static uint64_t t0; // when the recording started
+static atomic_uint nextconn; // the next connection id
+
+static __thread char buf[RECBUF]; // this thread's records since its last flush
+static __thread size_t len; // bytes in buf
+static __thread uint64_t last; // the time of this thread's previous record
+static __thread int myshard; // the shard this thread runs
+
+// This function returns the time in microseconds
+static uint64_t now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// This function writes v as a varint at p and returns the end
+static char *putvar(char *p, uint64_t v)
+{
+    while (v >= 0x80)
+    {
+	*p++ = (char)(v | 0x80);
+	v >>= 7;
+    }
+    *p++ = (char)v;
+    return p;
+}
+
+// This function reads a varint from *p (before end) into *v
+// It returns 0, or -1 if the varint runs past end
+static int getvar(const char **p, const char *end, uint64_t *v)
+{
+    int shift = 0;
+    *v = 0;
+    while (*p < end && shift < 64)
+    {
+	unsigned char c = *(*p)++;
+	*v |= (uint64_t)(c & 0x7f) << shift;
+	if (!(c & 0x80))
+	    return 0;
+	shift += 7;
+    }
+    return -1;
+}
+
+// This function writes n bytes to the recording, all of them
+static void writeall(const char *p, size_t n)
+{
+    ssize_t k;
+    while (n > 0)
+    {
+	if ((k = write(recfd, p, n)) < 0)
+	{
+	    perror("recording");
+	    close(recfd);
+	    recfd = -1; // stop, the server carries on
+	    return;
+	}
+	p += k;
+	n -= k;
+    }
+}
+
+//============================================
+// Writing
+//============================================
+
+// This function creates the recording at path, for a server seeded with seed running nshards
+// It returns 0, or -1 if the file can't be created
+int rec_start(const char *path, unsigned int seed, int nshards)
+{
+    char head[32], *p;
+    if ((recfd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)) < 0)
+	return -1;
+    memcpy(head, MAGIC, 5);
+    p = putvar(head + 5, VERSION);
+    p = putvar(p, seed);
+    p = putvar(p, nshards);
+    writeall(head, p - head);
+    t0 = now();
+    return 0;
+}
+
+// This function appends the head of a record of type for conn
+// It makes room first if the record (with extra bytes of data) wouldn't fit
+static void put(int type, uint32_t conn, size_t extra)
+{
+    uint64_t t = now() - t0;
+    char *p;
+    if (len + 4 * MAXVARINT + extra > RECBUF)
+	rec_flush();
+    p = putvar(buf + len, t - last);
+    *p++ = (char)type;
+    p = putvar(p, conn);
+    len = p - buf;
+    last = t;
+}
+
+// This function returns the id of a connection just accepted and logs its opening
+uint32_t rec_conn(void)
+{
+    uint32_t id = atomic_fetch_add(&nextconn, 1);
+    if (recfd >= 0)
+	put(REC_OPEN, id, 0);
+    return id;
+}
+
+// This function logs n bytes received on conn
+void rec_data(uint32_t conn, const char *s, size_t n)
+{
+    size_t k;
+    if (recfd < 0)
+	return;
+    while (n > 0) // in pieces if n is more than a buffer
+    {
+	k = n < RECBUF / 2 ? n : RECBUF / 2;
+	put(REC_DATA, conn, k);
+	len = putvar(buf + len, k) - buf;
+	memcpy(buf + len, s, k);
+	len += k;
+	s += k;
+	n -= k;
+    }
+}
+
+// This function logs that conn was closed
+void rec_close(uint32_t conn)
+{
+    if (recfd >= 0)
+	put(REC_CLOSE, conn, 0);
+}
+
+// This function tells the recording which shard this thread runs
+// (the times in a block are deltas along that shard's records)
+void rec_thread(int shard)
+{
+    myshard = shard;
+}
+
+// This function appends this thread's records to the file as one block
+void rec_flush(void)
+{
+    char head[2 * MAXVARINT], *p;
+    if (recfd < 0 || len == 0)
+	return;
+    p = putvar(head, myshard);
+    p = putvar(p, len);
+    pthread_mutex_lock(&lock);
+    writeall(head, p - head);
+    if (recfd >= 0)
+	writeall(buf, len);
+    pthread_mutex_unlock(&lock);
+    len = 0;
+}
+
+//============================================
+// Reading
+//============================================
+
+// This function orders events by time, then by where they were in the file
+static int bytime(const void *a, const void *b)
+{
+    const struct recevent *x = a, *y = b;
+    if (x->t != y->t)
+	return x->t < y->t ? -1 : 1;
+    return x->seq < y->seq ? -1 : (x->seq > y->seq);
+}
+
+// This function reads the recording at path into r, its events sorted by time
+// (each shard's records are in order already, the blocks of different shards interleave)
+// The server stops by being killed, so the last block may be cut off (it is written with two
+// write()s): loading stops there and keeps what came before it, with r->torn set
+// It returns 0, or -1 if the file can't be read or isn't a recording (r is freed then)
+int rec_load(const char *path, struct recording *r)
+{
+    uint64_t v, shard, blen, dt, type, conn, n;
+    uint64_t times[256] = { 0 }; // each shard's clock
+    const char *p, *end, *bend;
+    size_t cap = 0, size;
+    FILE *f;
+    memset(r, 0, sizeof(*r));
+    if (!(f = fopen(path, "rb")))
+	return -1;
+    fseek(f, 0, SEEK_END);
+    size = ftell(f);
+    rewind(f);
+    if (!(r->file = malloc(size ? size : 1)) || fread(r->file, 1, size, f) != size)
+    {
+	fclose(f);
+	goto fail;
+    }
+    fclose(f);
+    p = r->file;
+    end = p + size;
+    if (size < 5 || memcmp(p, MAGIC, 5))
+	goto fail;
+    p += 5;
+    if (getvar(&p, end, &v) < 0 || v != VERSION)
+	goto fail;
+    if (getvar(&p, end, &v) < 0)
+	goto fail;
+    r->seed = v;
+    if (getvar(&p, end, &v) < 0)
+	goto fail;
+    r->nshards = v;
+    while (p < end && !r->torn)
+    {
+	if (getvar(&p, end, &shard) < 0 || getvar(&p, end, &blen) < 0 || blen > (uint64_t)(end - p) || shard > 255)
+	{
+	    r->torn = 1; // cut off, e.g. the server was killed mid-write
+	    break;
+	}
+	for (bend = p + blen; p < bend; )
+	{
+	    if (r->n == cap)
+	    {
+		cap = cap ? cap * 2 : 4096;
+		struct recevent *t = realloc(r->ev, cap * sizeof(*t));
+		if (!t)
+		    goto fail;
+		r->ev = t;
+	    }
+	    struct recevent *e = &r->ev[r->n];
+	    if (getvar(&p, bend, &dt) < 0 || p == bend)
+	    {
+		r->torn = 1; // a broken record, nothing after it is trusted
+		break;
+	    }
+	    type = (unsigned char)*p++;
+	    if (getvar(&p, bend, &conn) < 0)
+	    {
+		r->torn = 1;
+		break;
+	    }
+	    e->t = times[shard] += dt;
+	    e->seq = r->n;
+	    e->type = type;
+	    e->conn = conn;
+	    e->data = NULL;
+	    e->len = 0;
+	    if (type == REC_DATA)
+	    {
+		if (getvar(&p, bend, &n) < 0 || n > (uint64_t)(bend - p))
+		{
+		    r->torn = 1;
+		    break;
+		}
+		e->data = p;
+		e->len = n;
+		p += n;
+	    }
+	    if (conn + 1 > r->nconns)
+		r->nconns = conn + 1;
+	    r->n++;
+	}
+    }
+    qsort(r->ev, r->n, sizeof(*r->ev), bytime);
+    return 0;
+fail:
+    rec_free(r);
+    return -1;
+}
+
+// This function frees what rec_load() allocated, also for a recording it gave up on
+void rec_free(struct recording *r)
+{
+    free(r->ev);
+    free(r->file);
+    r->ev = NULL;
+    r->file = NULL;
+    r->n = 0;
+}
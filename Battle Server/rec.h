@@ -0,0 +1,57 @@
+// rec - recording of the server's inbound traffic, and reading it back
+// With -R the server logs when each connection opens and closes and every byte it receives,
+// with timestamps, so the same workload can be replayed against any build (replay.c).
+// Each shard buffers its records and appends them as one block per loop iteration; the
+// numbers are LEB128 varints and the times are deltas, so a short line costs a few bytes.
+//
+// File: "BSREC" version(1) seed nshards, then blocks
+// Block: shard length records...
+// Record: dt(us since the shard's previous record) type conn [length bytes...]
+#ifndef REC_H
+#define REC_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define REC_OPEN 1 // a connection was accepted
+#define REC_DATA 2 // bytes received on it
+#define REC_CLOSE 3 // it was closed
+
+// One record read back, with its time since the recording started
+struct recevent
+{
+    uint64_t t; // microseconds
+    int type; // REC_OPEN, REC_DATA or REC_CLOSE
+    uint32_t conn; // connection id, numbered from 0 in the order they opened
+    const char *data; // the bytes of a REC_DATA (inside the loaded file)
+    size_t len;
+    size_t seq; // its place in the file, so events at the same time keep their order
+};
+
+// A recording loaded into memory
+struct recording
+{
+    unsigned int seed; // the server's seed (-S)
+    int nshards; // the threads it ran
+    uint32_t nconns; // connections (one more than the largest id)
+    struct recevent *ev; // every record, in time order
+    size_t n;
+    char *file; // the file's bytes, which the events point into
+    int torn; // 1 if it was cut off (the events before that are loaded)
+};
+
+//============================================
+// Function Prototypes
+//============================================
+// Writing (the server)
+int rec_start(const char *path, unsigned int seed, int nshards); // create the file, -1 on error
+uint32_t rec_conn(void); // a new connection's id, logs REC_OPEN
+void rec_data(uint32_t conn, const char *buf, size_t n); // log n bytes received
+void rec_close(uint32_t conn); // log the close
+void rec_thread(int shard); // this thread runs shard
+void rec_flush(void); // append this thread's records as one block
+// Reading (the replay tool)
+int rec_load(const char *path, struct recording *r); // read and sort a recording, -1 on error
+void rec_free(struct recording *r); // free a loaded recording
+
+#endif
@@ -0,0 +1,462 @@
+// replay - plays a recording of the battleserver's inbound traffic (-R) back against a server
+// Every recorded connection is opened again over loopback and sent the same bytes, at the
+// recorded times (1x) or as fast as the server answers (-f); what the server sends back
+// is read and counted. With -f a connection sends its next line when the server prompts it
+// (for its name, or with its options on its turn), the lines in between (a yell, a watch)
+// going along with it, and closes on the prompt after its last line: the battles are played,
+// not raced past. A connection that isn't prompted for STALL sends the rest of its lines,
+// and closes once it is prompted again or quiet for another STALL.
+// Start the server with the recording's seed (printed first) so the damage rolls are the
+// same, then compare the reports of two builds.
+//
+// >> ./battleserver -S 7 -R run.rec        (record)
+// >> ./replay run.rec                      (replay at 1x)
+// >> ./replay -f run.rec                   (as fast as the server answers)
+#ifndef PORT
+    #define PORT 30130 // in case use gcc instead of makefile
+#endif
+//============================================
+// Header Files
+//============================================
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <errno.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include "rec.h"
+#include "hist.h"
+
+//============================================
+// Globals
+//============================================
+#define MAXEVENTS 256
+#define LINGER 2000000 // us to keep reading after the last record, for the last replies
+#define STALL 500000 // -f: us without a prompt (or anything) after which a connection sends the rest
+#define MAXPROMPT 64 // bytes of each server line kept to look for a prompt
+
+// One recorded connection
+struct rconn
+{
+    int fd; // -1 before it opens and after it closes
+    int connected; // 1 once connect() finished
+    int closing; // 1 if the recording closed it, it is shut once out is sent
+    int wantout; // 1 while epoll watches it for EPOLLOUT
+    char *out; // bytes due but not yet sent (-f: all its bytes not yet sent)
+    size_t outlen, outcap;
+    // -f only
+    size_t due; // bytes of out released to be sent
+    int recclose; // 1 if the recording closed it, closing is set on the prompt after its last line
+    int named; // 1 once its first line (its name) was released
+    uint64_t heard; // when it last sent or received anything
+    int inlen; // bytes of the server's current line in in
+    char in[MAXPROMPT];
+};
+
+static struct rconn *conns;
+static struct recording rec;
+static struct sockaddr_in server;
+static int epfd;
+static int fast = 0; // -f
+static int naddrs = 1; // -a: connections are spread over this many addresses from host
+
+// Results
+static long nopened, nfailed, nerrors, nsent, nreceived;
+static long nprompted, nstalled; // -f: lines released on a prompt, and for want of one
+static uint64_t t0; // when the replay started
+static struct hist late; // how far behind its recorded time each record was played, in us
+
+//============================================
+// Function Prototypes
+//============================================
+static uint64_t now(void); // microseconds
+static void play(struct recevent *e); // act on one record
+static void trysend(struct rconn *c); // send what c has due
+static void release(struct rconn *c, int all); // -f: let c send up to its next move, or all of it
+static void heard(struct rconn *c, const char *buf, size_t n); // -f: look for prompts in what c got
+static int ismove(const char *s, size_t n); // 1 if line s ends a turn
+static void finish(struct rconn *c, int error); // close c
+static void watchout(struct rconn *c, int on); // watch c for EPOLLOUT or stop
+static void usage(char *prog);
+
+//============================================
+// Main Function
+//============================================
+
+int main(int argc, char **argv)
+{
+    struct epoll_event ev[MAXEVENTS];
+    struct rlimit rl;
+    char *host = "127.0.0.1", buf[65536];
+    int port = PORT, c, i, n, timeout, open = 0, pending = 0;
+    size_t next = 0;
+    uint64_t t, done = 0, scanned = 0;
+    while ((c = getopt(argc, argv, "h:p:fa:")) != -1)
+    {
+	switch (c)
+	{
+	case 'h': host = optarg; break;
+	case 'p': port = atoi(optarg); break;
+	case 'f': fast = 1; break;
+	case 'a': naddrs = atoi(optarg); break;
+	default: usage(argv[0]);
+	}
+    }
+    if (optind != argc - 1 || naddrs < 1)
+	usage(argv[0]);
+    if (rec_load(argv[optind], &rec) < 0)
+    {
+	fprintf(stderr, "%s: not a readable recording\n", argv[optind]);
+	exit(1);
+    }
+    printf("recording: %zu records, %u connections, %.1f s, seed %u, %d threads\n",
+	    rec.n, rec.nconns, rec.n ? rec.ev[rec.n - 1].t / 1e6 : 0.0, rec.seed, rec.nshards);
+    printf("recording: start the server under test with -S %u -t %d -L 0\n", rec.seed, rec.nshards);
+    if (rec.torn)
+	printf("recording: cut off at the end (the server was killed mid-write), replaying what came before\n");
+    fflush(stdout);
+    (void)signal(SIGPIPE, SIG_IGN);
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0)
+    {
+	rl.rlim_cur = rl.rlim_max;
+	setrlimit(RLIMIT_NOFILE, &rl);
+    }
+    memset(&server, 0, sizeof(server));
+    server.sin_family = AF_INET;
+    server.sin_port = htons(port);
+    if (inet_pton(AF_INET, host, &server.sin_addr) != 1)
+    {
+	fprintf(stderr, "bad address %s\n", host);
+	exit(1);
+    }
+    if ((epfd = epoll_create1(0)) < 0)
+    {
+	perror("epoll_create1");
+	exit(1);
+    }
+    if (!(conns = calloc(rec.nconns ? rec.nconns : 1, sizeof(struct rconn))))
+    {
+	fprintf(stderr, "out of memory!\n");
+	exit(1);
+    }
+    for (i = 0; i < (int)rec.nconns; i++)
+	conns[i].fd = -1;
+    t0 = now();
+    while (1)
+    {
+	// Everything due by now (everything, with -f)
+	t = now() - t0;
+	for (; next < rec.n && (fast || rec.ev[next].t <= t); next++)
+	    play(&rec.ev[next]);
+	if (next == rec.n && now() - scanned >= 10000)
+	{
+	    // With -f a connection is pending until its last line is released and its close is due;
+	    // one the server didn't prompt for STALL goes on anyway
+	    scanned = now();
+	    for (open = pending = 0, i = 0; i < (int)rec.nconns; i++)
+	    {
+		struct rconn *cn = &conns[i];
+		if (cn->fd < 0)
+		    continue;
+		open++;
+		if (fast && (cn->due < cn->outlen || (cn->recclose && !cn->closing)))
+		{
+		    pending++;
+		    if (cn->connected && scanned - cn->heard >= STALL)
+		    {
+			nstalled++;
+			release(cn, 1);
+		    }
+		}
+	    }
+	    if (!pending && !done)
+		done = now();
+	    if (!open || (done && now() - done > LINGER))
+		break;
+	}
+	if (next < rec.n && !fast)
+	    timeout = (int)((rec.ev[next].t - t) / 1000) + 1;
+	else
+	    timeout = next < rec.n ? 0 : 100;
+	if ((n = epoll_wait(epfd, ev, MAXEVENTS, timeout)) < 0)
+	{
+	    if (errno == EINTR)
+		continue;
+	    perror("epoll_wait");
+	    exit(1);
+	}
+	for (i = 0; i < n; i++)
+	{
+	    struct rconn *cn = &conns[ev[i].data.u32];
+	    ssize_t k;
+	    if (cn->fd < 0)
+		continue;
+	    if (!cn->connected && (ev[i].events & (EPOLLOUT | EPOLLERR | EPOLLHUP)))
+	    {
+		int err = 0;
+		socklen_t len = sizeof(err);
+		getsockopt(cn->fd, SOL_SOCKET, SO_ERROR, &err, &len);
+		if (err)
+		{
+		    nfailed++;
+		    finish(cn, 0);
+		    continue;
+		}
+		cn->connected = 1;
+	    }
+	    if (ev[i].events & EPOLLIN)
+	    {
+		while (cn->fd >= 0 && (k = read(cn->fd, buf, sizeof(buf))) > 0)
+		{
+		    nreceived += k;
+		    if (fast)
+			heard(cn, buf, k); // may send, or close it
+		}
+		if (cn->fd < 0)
+		    continue;
+		if (k == 0) // the server closed it
+		{
+		    finish(cn, 0);
+		    continue;
+		}
+		if (errno != EAGAIN)
+		{
+		    finish(cn, 1);
+		    continue;
+		}
+	    }
+	    trysend(cn);
+	}
+    }
+    t = now() - t0;
+    printf("replayed: %.2f s%s, connections: %ld opened, %ld failed, %ld errors\n",
+	    t / 1e6, fast ? " (paced on the server's prompts)" : "", nopened, nfailed, nerrors);
+    printf("bytes: %ld sent, %ld received\n", nsent, nreceived);
+    if (fast)
+	printf("lines released: %ld on the server's prompt, %ld after %d ms without one\n",
+		nprompted, nstalled, STALL / 1000);
+    else
+	printf("send lag behind the recording (us): p50 %lu p99 %lu max %lu\n",
+		(unsigned long)hist_pct(&late, 50), (unsigned long)hist_pct(&late, 99),
+		(unsigned long)late.max);
+    if (nopened && !nreceived)
+    {
+	fflush(stdout);
+	fprintf(stderr, "the server sent nothing back: is it running, with -L 0?\n");
+	return 1;
+    }
+    return 0;
+}
+
+//============================================
+// Helper Functions
+//============================================
+
+// This function returns the current time in microseconds
+static uint64_t now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// This function does what record e says: open its connection, queue its bytes or close it
+static void play(struct recevent *e)
+{
+    struct rconn *c = &conns[e->conn];
+    struct sockaddr_in to = server;
+    int on = 1;
+    switch (e->type)
+    {
+    case REC_OPEN:
+	if ((c->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0)) < 0)
+	{
+	    nfailed++;
+	    return;
+	}
+	setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+	to.sin_addr.s_addr = htonl(ntohl(server.sin_addr.s_addr) + e->conn % naddrs);
+	if (connect(c->fd, (struct sockaddr *)&to, sizeof(to)) < 0 && errno != EINPROGRESS)
+	{
+	    nfailed++;
+	    close(c->fd);
+	    c->fd = -1;
+	    return;
+	}
+	struct epoll_event ev = { EPOLLIN | EPOLLOUT, { .u32 = e->conn } }; // EPOLLOUT when connected
+	epoll_ctl(epfd, EPOLL_CTL_ADD, c->fd, &ev);
+	c->connected = c->closing = c->outlen = 0;
+	c->due = c->recclose = c->named = c->inlen = 0;
+	c->heard = now();
+	c->wantout = 1;
+	nopened++;
+	break;
+    case REC_DATA:
+	if (c->fd < 0)
+	    return; // it never opened
+	if (c->outlen + e->len > c->outcap)
+	{
+	    size_t cap = c->outcap ? c->outcap : 256;
+	    while (cap < c->outlen + e->len)
+		cap *= 2;
+	    if (!(c->out = realloc(c->out, cap)))
+	    {
+		fprintf(stderr, "out of memory!\n");
+		exit(1);
+	    }
+	    c->outcap = cap;
+	}
+	memcpy(c->out + c->outlen, e->data, e->len);
+	c->outlen += e->len;
+	if (fast)
+	    return; // it waits for a prompt
+	c->due = c->outlen;
+	hist_add(&late, now() - t0 - e->t);
+	trysend(c);
+	break;
+    case REC_CLOSE:
+	if (c->fd < 0)
+	    return;
+	if (fast)
+	{
+	    c->recclose = 1; // it waits for a prompt too
+	    return;
+	}
+	c->closing = 1;
+	trysend(c);
+	break;
+    }
+}
+
+// This function sends as much of c's due bytes as the socket takes,
+// and closes c if the recording closed it and everything was sent
+static void trysend(struct rconn *c)
+{
+    ssize_t k;
+    if (c->fd < 0 || !c->connected)
+	return;
+    while (c->due > 0)
+    {
+	if ((k = write(c->fd, c->out, c->due)) < 0)
+	{
+	    if (errno == EAGAIN)
+		watchout(c, 1); // the rest goes when it is writable
+	    else
+		finish(c, 1);
+	    return;
+	}
+	nsent += k;
+	c->due -= k;
+	c->outlen -= k;
+	memmove(c->out, c->out + k, c->outlen);
+	c->heard = now();
+    }
+    if (c->closing && !c->outlen)
+	finish(c, 0);
+    else
+	watchout(c, 0);
+}
+
+// This function releases c's lines up to and including its next move (or its name, the
+// first line), or all of them if all (it stalled: the server isn't going to prompt it, say
+// it waits for an opponent who doesn't come), or, once they all were, closes c if the
+// recording did
+static void release(struct rconn *c, int all)
+{
+    char *s, *nl;
+    size_t n;
+    c->heard = now();
+    if (c->due == c->outlen)
+    {
+	if (c->recclose)
+	    c->closing = 1;
+    }
+    while (c->due < c->outlen)
+    {
+	s = c->out + c->due;
+	nl = memchr(s, '\n', c->outlen - c->due);
+	n = nl ? (size_t)(nl - s) + 1 : c->outlen - c->due; // a last line may have no newline
+	c->due += n;
+	if (!all && (!c->named || ismove(s, n)))
+	    break;
+    }
+    c->named = 1;
+    trysend(c);
+}
+
+// This function reads n bytes the server sent c, a line at a time (the first MAXPROMPT - 1
+// bytes of each are kept), and releases c's next lines on every prompt
+static void heard(struct rconn *c, const char *buf, size_t n)
+{
+    static const char name[] = "Please enter your name:", options[] = "Here are your list of options,";
+    size_t i;
+    c->heard = now();
+    for (i = 0; i < n && c->fd >= 0; i++)
+    {
+	if (buf[i] != '\n')
+	{
+	    if (c->inlen < MAXPROMPT - 1)
+		c->in[c->inlen++] = buf[i];
+	    continue;
+	}
+	c->in[c->inlen] = '\0';
+	c->inlen = 0;
+	if (!strncmp(c->in, name, sizeof(name) - 1) || !strncmp(c->in, options, sizeof(options) - 1))
+	{
+	    nprompted++;
+	    release(c, 0);
+	}
+    }
+}
+
+// This function returns 1 if the server takes line s (n bytes, with its newline) as a move,
+// the way it parses one: not a yell, and an 'a' or 'p' that is its only one and its last byte
+static int ismove(const char *s, size_t n)
+{
+    const char *y, *m;
+    while (n > 0 && (s[n - 1] == '\n' || s[n - 1] == '\r'))
+	n--;
+    if (n == 0)
+	return 0;
+    if ((y = memchr(s, 'y', n)) && y == s + n - 1)
+	return 0; // a yell, its message comes next
+    return ((m = memchr(s, 'a', n)) && m == s + n - 1) || ((m = memchr(s, 'p', n)) && m == s + n - 1);
+}
+
+// This function starts (on) or stops watching c for EPOLLOUT
+static void watchout(struct rconn *c, int on)
+{
+    struct epoll_event ev = { EPOLLIN | (on ? EPOLLOUT : 0), { .u32 = c - conns } };
+    if (c->wantout == on)
+	return;
+    epoll_ctl(epfd, EPOLL_CTL_MOD, c->fd, &ev);
+    c->wantout = on;
+}
+
+// This function closes c, counting an error if it was unexpected
+static void finish(struct rconn *c, int error)
+{
+    if (error)
+	nerrors++;
+    close(c->fd); // also removes it from epoll
+    c->fd = -1;
+    c->outlen = c->due = 0;
+}
+
+// This function prints the command line options and exits
+static void usage(char *prog)
+{
+    fprintf(stderr, "usage: %s [-h host] [-p port] [-f] [-a addrs] recording\n", prog);
+    fprintf(stderr, "  -f  send each connection's next line on the server's prompt, not at the recorded times\n");
+    fprintf(stderr, "  -a addrs  spread connections over addrs consecutive addresses from host (default 1)\n");
+    fprintf(stderr, "The server under test needs the recording's -S and -t, and -L 0: its default line limit cuts -f off\n");
+    exit(1);
+}
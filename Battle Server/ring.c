@@ -0,0 +1,289 @@
+// Line framing on a ring buffer
+// Lines end at \r, \n or \r\n; empty lines are skipped, so \r\n counts once.
+// A line longer than max is cut at max bytes, the rest starts the next line.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "ring.h"
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86 1
+#endif
+
+#define MASK (RINGSIZE - 1)
+
+//============================================
+// Delimiter scanners
+//============================================
+// Each returns the offset of the first \r or \n in base[from..to), or to if there is none
+// base is a ring's data, so the vector scanners may load any whole 16 or 32 byte block
+// of it (RINGSIZE is a multiple of 32) and mask off the bytes outside [from, to)
+
+// This function checks one byte at a time
+static size_t scan_scalar(const char *base, size_t from, size_t to)
+{
+    size_t i;
+    for (i = from; i < to; i++)
+    {
+	if (base[i] == '\n' || base[i] == '\r')
+	    break;
+    }
+    return i;
+}
+
+#ifdef HAVE_X86
+// This function checks 16 bytes per compare
+__attribute__((target("sse2")))
+static size_t scan_sse2(const char *base, size_t from, size_t to)
+{
+    const __m128i cr = _mm_set1_epi8('\r'), lf = _mm_set1_epi8('\n');
+    size_t i;
+    unsigned int m;
+    __m128i v;
+    // Commands are one letter, so their delimiter is found before any block is loaded
+    for (i = from; i < to && i < from + 2; i++)
+    {
+	if (base[i] == '\n' || base[i] == '\r')
+	    return i;
+    }
+    i = from & ~(size_t)15; // the block from is in
+    v = _mm_loadu_si128((const __m128i *)(base + i));
+    m = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, cr), _mm_cmpeq_epi8(v, lf)));
+    m &= ~0u << (from - i); // ignore the bytes before from
+    while (!m)
+    {
+	i += 16;
+	if (i >= to)
+	    return to;
+	v = _mm_loadu_si128((const __m128i *)(base + i));
+	m = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, cr), _mm_cmpeq_epi8(v, lf)));
+    }
+    i += __builtin_ctz(m); // the lowest set bit is the first delimiter
+    return i < to ? i : to;
+}
+
+// This function checks 32 bytes per compare
+__attribute__((target("avx2")))
+static size_t scan_avx2(const char *base, size_t from, size_t to)
+{
+    const __m256i cr = _mm256_set1_epi8('\r'), lf = _mm256_set1_epi8('\n');
+    size_t i;
+    unsigned int m;
+    __m256i v;
+    for (i = from; i < to && i < from + 2; i++)
+    {
+	if (base[i] == '\n' || base[i] == '\r')
+	    return i;
+    }
+    i = from & ~(size_t)31;
+    v = _mm256_loadu_si256((const __m256i *)(base + i));
+    m = _mm256_movemask_epi8(_mm256_or_si256(_mm256_cmpeq_epi8(v, cr), _mm256_cmpeq_epi8(v, lf)));
+    m &= ~0u << (from - i);
+    while (!m)
+    {
+	i += 32;
+	if (i >= to)
+	    return to;
+	v = _mm256_loadu_si256((const __m256i *)(base + i));
+	m = _mm256_movemask_epi8(_mm256_or_si256(_mm256_cmpeq_epi8(v, cr), _mm256_cmpeq_epi8(v, lf)));
+    }
+    i += __builtin_ctz(m);
+    return i < to ? i : to;
+}
+#endif
+
+// The scanners, fastest first
+static const struct
+{
+    const char *name;
+    size_t (*fn)(const char *base, size_t from, size_t to);
+} scanners[] = {
+#ifdef HAVE_X86
+    { "avx2", scan_avx2 },
+    { "sse2", scan_sse2 },
+#endif
+    { "scalar", scan_scalar },
+};
+#define NSCANNERS (int)(sizeof(scanners) / sizeof(scanners[0]))
+
+static int scanner = NSCANNERS - 1; // index of the scanner in use, set before main() runs
+
+// This function returns 1 if this CPU can run scanners[i]
+static int supported(int i)
+{
+#ifdef HAVE_X86
+    __builtin_cpu_init();
+    if (scanners[i].fn == scan_avx2)
+	return __builtin_cpu_supports("avx2");
+    if (scanners[i].fn == scan_sse2)
+	return __builtin_cpu_supports("sse2");
+#endif
+    return 1;
+}
+
+// This function picks the fastest scanner the CPU supports when the program starts,
+// before any thread can scan
+__attribute__((constructor))
+static void pickscanner(void)
+{
+    ring_setscanner(NULL);
+}
+
+// This function selects the scanner called name, or the fastest one if name is NULL
+// It returns 0, or -1 if there is no such scanner or the CPU can't run it
+int ring_setscanner(const char *name)
+{
+    int i;
+    for (i = 0; i < NSCANNERS; i++)
+    {
+	if ((!name || strcmp(name, scanners[i].name) == 0) && supported(i))
+	{
+	    scanner = i;
+	    return 0;
+	}
+    }
+    return -1;
+}
+
+// This function returns the name of the scanner in use
+const char *ring_scanner(void)
+{
+    return scanners[scanner].name;
+}
+
+//============================================
+// Ring buffer
+//============================================
+
+// This function empties the ring
+void ring_init(struct ring *r)
+{
+    r->head = r->scan = r->tail = 0;
+}
+
+// Rings put back on this thread, the link to the next is kept in data
+static __thread struct ring *ringfree = NULL;
+
+// This function returns an empty ring, from this thread's free rings if it has one
+struct ring *ring_get(void)
+{
+    struct ring *r;
+    if ((r = ringfree))
+	memcpy(&ringfree, r->data, sizeof(ringfree));
+    else if (!(r = malloc(sizeof(struct ring))))
+    {
+	fprintf(stderr, "out of memory!\n");
+	exit(1);
+    }
+    ring_init(r);
+    return r;
+}
+
+// This function puts r on this thread's free rings (r may come from another thread's)
+void ring_put(struct ring *r)
+{
+    memcpy(r->data, &ringfree, sizeof(ringfree));
+    ringfree = r;
+}
+
+// This function returns the number of bytes in r not yet handed out as lines
+size_t ring_used(const struct ring *r)
+{
+    return r->tail - r->head;
+}
+
+// This function copies the buffered bytes, oldest first, to out (which has RINGSIZE bytes)
+// It returns how many there are
+size_t ring_peek(const struct ring *r, char *out)
+{
+    unsigned int h = r->head & MASK;
+    size_t n = r->tail - r->head, k = n < RINGSIZE - h ? n : RINGSIZE - h;
+    memcpy(out, r->data + h, k);
+    memcpy(out + k, r->data, n - k); // the part that wrapped round
+    return n;
+}
+
+// This function points iov at the free space after tail, which is split in two
+// if it wraps around the end of data
+// It returns the number of iovecs used (0 if the ring is full)
+int ring_space(struct ring *r, struct iovec iov[2])
+{
+    unsigned int t = r->tail & MASK;
+    size_t room = RINGSIZE - (r->tail - r->head);
+    if (room == 0)
+	return 0;
+    iov[0].iov_base = r->data + t;
+    if (t + room <= RINGSIZE)
+    {
+	iov[0].iov_len = room;
+	return 1;
+    }
+    iov[0].iov_len = RINGSIZE - t;
+    iov[1].iov_base = r->data;
+    iov[1].iov_len = room - (RINGSIZE - t);
+    return 2;
+}
+
+// This function adds n bytes read into the space ring_space() described
+void ring_fill(struct ring *r, size_t n)
+{
+    r->tail += n;
+}
+
+// This function returns the line from head to end (exclusive) as a string and consumes it
+// A line that ends at its delimiter is terminated in place, over the delimiter;
+// one that wraps, or that was cut at max (so the next byte is not ours), is copied to scratch
+static char *takeline(struct ring *r, unsigned int end, int indelim, char *scratch)
+{
+    unsigned int h = r->head & MASK;
+    size_t len = end - r->head;
+    char *s;
+    if (indelim && h + len < RINGSIZE)
+    {
+	s = r->data + h;
+	s[len] = '\0';
+    }
+    else
+    {
+	size_t first = len < RINGSIZE - h ? len : RINGSIZE - h;
+	memcpy(scratch, r->data + h, first);
+	memcpy(scratch + first, r->data, len - first);
+	scratch[len] = '\0';
+	s = scratch;
+    }
+    r->head = r->scan;
+    return s;
+}
+
+// This function returns the next complete line as a string, or NULL if there is none yet
+// Every byte is searched once: scan remembers how far the last call got
+// The string stays valid until the next call; scratch must hold max + 1 bytes
+char *ring_line(struct ring *r, char *scratch, int max)
+{
+    while (r->scan != r->tail)
+    {
+	unsigned int s = r->scan & MASK;
+	size_t n = r->tail - r->scan; // unsearched bytes
+	size_t k;
+	if (n > RINGSIZE - s)
+	    n = RINGSIZE - s; // search up to the end of data, the rest on the next pass
+	k = scanners[scanner].fn(r->data, s, s + n) - s;
+	if (r->scan - r->head + k >= (size_t)max) // too long, the first max bytes are a line
+	{
+	    r->scan = r->head + max;
+	    return takeline(r, r->scan, 0, scratch);
+	}
+	r->scan += k;
+	if (k == n)
+	    continue; // no delimiter in this piece
+	// r->scan is at a delimiter
+	if (r->scan == r->head) // empty line (or the \n of a \r\n)
+	{
+	    r->head = ++r->scan;
+	    continue;
+	}
+	r->scan++; // consume the delimiter with the line
+	return takeline(r, r->scan - 1, 1, scratch);
+    }
+    return NULL;
+}
@@ -0,0 +1,38 @@
+// ring - per-connection input ring buffer that frames lines in place
+// One read() can bring in several lines, ring_line() hands them out one at a time
+// without moving the bytes; only a line that wraps around the end of the buffer is copied
+// Delimiters are found with SSE2 or AVX2 when the CPU has them (picked at startup)
+// Rings come from a per-thread pool, so a connection only holds one while it has input buffered
+#ifndef RING_H
+#define RING_H
+
+#include <stddef.h>
+#include <sys/uio.h> // struct iovec
+
+#define RINGSIZE 256 // bytes of input buffered per connection, a power of two (at least 32)
+
+// The positions count bytes since the connection opened and are reduced
+// modulo RINGSIZE only to index data, so head <= scan <= tail always holds
+struct ring
+{
+    char data[RINGSIZE];
+    unsigned int head; // first byte of the line being framed
+    unsigned int scan; // first byte not yet searched for \r or \n
+    unsigned int tail; // where the next read() puts its bytes
+};
+
+//============================================
+// Function Prototypes
+//============================================
+void ring_init(struct ring *r); // empty the ring
+struct ring *ring_get(void); // an empty ring from this thread's pool
+void ring_put(struct ring *r); // give a ring back to this thread's pool
+size_t ring_used(const struct ring *r); // bytes buffered, 0 once every line was handed out
+size_t ring_peek(const struct ring *r, char *out); // copy the buffered bytes to out (RINGSIZE bytes), returns how many
+int ring_space(struct ring *r, struct iovec iov[2]); // describe the free space for readv(), returns the iov count
+void ring_fill(struct ring *r, size_t n); // n bytes were read into the free space
+char *ring_line(struct ring *r, char *scratch, int max); // the next line, or NULL if none is complete (max < RINGSIZE)
+int ring_setscanner(const char *name); // "avx2", "sse2", "scalar" or NULL for the fastest, -1 if unsupported
+const char *ring_scanner(void); // name of the scanner in use
+
+#endif
@@ -0,0 +1,110 @@
+// The room directory for the battleserver
+// Players join a room once, when they name themselves, so one mutex is enough;
+// nothing on the per-turn path touches it.
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include "room.h"
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static int size = 1; // most players per room
+static int nshards = 1; // room r is hosted by shard r % nshards
+static int *count = NULL; // players in each room
+static int nrooms = 0; // rooms opened
+static int cap = 0; // slots in count
+static int *open = NULL; // open[s]: every room of shard s below this one is full
+static int turn = 0; // the shard whose open room is looked at first
+
+// This function sets the room size and the number of shards the rooms are spread over
+void room_init(int n, int shards)
+{
+    size = n;
+    nshards = shards;
+    if (!(open = calloc(shards, sizeof(*open))))
+    {
+	fprintf(stderr, "out of memory!\n");
+	exit(1);
+    }
+    for (n = 0; n < shards; n++)
+	open[n] = n; // its first room
+}
+
+// This function opens rooms (empty) until there are n (the lock is held)
+static void openrooms(int n)
+{
+    while (nrooms < n)
+    {
+	if (nrooms == cap)
+	{
+	    int newcap = cap ? cap * 2 : 16;
+	    int *t = realloc(count, newcap * sizeof(*t));
+	    if (!t)
+	    {
+		fprintf(stderr, "out of memory!\n");
+		exit(1);
+	    }
+	    count = t;
+	    cap = newcap;
+	}
+	count[nrooms++] = 0;
+    }
+}
+
+// This function returns shard s's open room, its lowest numbered room with space,
+// opening it if every room it has is full (the lock is held)
+static int openroom(int s)
+{
+    int id;
+    for (id = open[s]; id < nrooms && count[id] >= size; id += nshards)
+	; // skip the full ones
+    openrooms(id + 1);
+    open[s] = id;
+    return id;
+}
+
+// This function puts a player in an open room: the first, starting at turn's shard, with fewer
+// than ROOMFILL players, or else the one with the fewest (the first of them from turn on a tie).
+// Once that room has its ROOMFILL (or is full) turn moves to the next shard, so the shards take
+// their turns even when a full room makes way for an empty one on the same shard.
+// It returns the room's id
+int room_join(void)
+{
+    int k, id, best = -1;
+    int fill = size < ROOMFILL ? size : ROOMFILL;
+    pthread_mutex_lock(&lock);
+    for (k = 0; k < nshards; k++)
+    {
+	id = openroom((turn + k) % nshards);
+	if (count[id] < fill)
+	{
+	    best = id; // still filling
+	    break;
+	}
+	if (best < 0 || count[id] < count[best])
+	    best = id;
+    }
+    if (++count[best] >= fill)
+	turn = (best % nshards + 1) % nshards;
+    pthread_mutex_unlock(&lock);
+    return best;
+}
+
+// This function takes a place in room id for a player that is already in it
+// (one handed over by the process before, see upgrade.h); the room may be over size
+void room_take(int id)
+{
+    pthread_mutex_lock(&lock);
+    openrooms(id + 1);
+    count[id]++;
+    pthread_mutex_unlock(&lock);
+}
+
+// This function gives back a player's place in room id
+void room_leave(int id)
+{
+    pthread_mutex_lock(&lock);
+    count[id]--;
+    if (id < open[id % nshards])
+	open[id % nshards] = id; // the next player fills the gap
+    pthread_mutex_unlock(&lock);
+}
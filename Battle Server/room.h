@@ -0,0 +1,22 @@
+// room - the directory of rooms, shared by every shard
+// A named player is put in a room and only meets (and hears about) players in the same room.
+// Room r is hosted by shard r % shards, and each shard has one open room (its lowest numbered
+// room with space). The shards' open rooms take ROOMFILL players (or as many as fit) each in
+// turn, round robin, so a few players land together instead of spread thin; past that a player
+// goes to the open room with the fewest, so rooms, and the matches in them, are spread over
+// every shard, also when rooms are smaller than ROOMFILL.
+// The directory only counts players, each room's lists live on the shard that hosts it.
+#ifndef ROOM_H
+#define ROOM_H
+
+#define ROOMFILL 8 // players an open room takes before the next shard's open room gets any
+
+//============================================
+// Function Prototypes
+//============================================
+void room_init(int size, int shards); // rooms hold at most size players, spread over shards
+int room_join(void); // take a place in an open room (see above), returns its id
+void room_take(int id); // take a place in room id, whatever room_join() would pick
+void room_leave(int id); // give the place back
+
+#endif
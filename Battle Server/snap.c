@@ -0,0 +1,209 @@
+// Snapshots of the battleserver's players
+// The writer runs in the forked child and only uses write(), rename() and a buffer on its
+// stack. The reader maps the file and builds two open-addressing tables over it: names
+// (a name may appear more than once, each record is claimed once) and match ids (the two
+// records of a match point at each other). Claims come from any shard, under one lock;
+// they only happen when a player names itself.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "snap.h"
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER; // for claimed
+static const struct snaprec *recs = NULL; // the mapped records
+static uint32_t nrecs = 0;
+static uint32_t *names = NULL; // record index + 1 by name hash, 0 if empty
+static int32_t *partner = NULL; // partner[i] is the other record of i's match, -1 if none
+static unsigned char *claimed = NULL; // 1 once a player came back as that record
+static uint32_t mask = 0; // slots in names - 1
+
+// This function hashes a name (FNV-1a)
+static uint32_t hash(const char *s)
+{
+    uint32_t h = 2166136261u;
+    for (; *s; s++)
+	h = (h ^ (unsigned char)*s) * 16777619u;
+    return h;
+}
+
+// This function writes out the records gathered in w
+static void drain(struct snapw *w)
+{
+    size_t n = w->nbuf * sizeof(struct snaprec);
+    if (!w->err && write(w->fd, w->buf, n) != (ssize_t)n)
+	w->err = 1;
+    w->nbuf = 0;
+}
+
+// This function starts a snapshot: path.tmp, with room left for the header
+// It returns 0, or -1 on error
+int snap_open(struct snapw *w, const char *path)
+{
+    struct snaphdr h;
+    w->path = path;
+    w->n = 0;
+    w->nbuf = 0;
+    w->err = 0;
+    if (snprintf(w->tmp, sizeof(w->tmp), "%s.tmp", path) >= (int)sizeof(w->tmp))
+	return -1;
+    if ((w->fd = open(w->tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)) < 0)
+	return -1;
+    memset(&h, 0, sizeof(h)); // filled in by snap_close()
+    if (write(w->fd, &h, sizeof(h)) != sizeof(h))
+	w->err = 1;
+    return 0;
+}
+
+// This function appends r to the snapshot
+void snap_add(struct snapw *w, const struct snaprec *r)
+{
+    w->buf[w->nbuf++] = *r;
+    w->n++;
+    if (w->nbuf == SNAPBUF)
+	drain(w);
+}
+
+// This function finishes the snapshot: the header goes in, and path.tmp replaces path,
+// so a crash while writing leaves the previous snapshot in place
+// It returns 0, or -1 on error
+int snap_close(struct snapw *w, int32_t nextmatch)
+{
+    struct snaphdr h;
+    drain(w);
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, SNAPMAGIC, sizeof(h.magic));
+    h.n = w->n;
+    h.nextmatch = nextmatch;
+    h.when = time(NULL);
+    if (pwrite(w->fd, &h, sizeof(h), 0) != sizeof(h))
+	w->err = 1;
+    if (close(w->fd) < 0 || w->err || rename(w->tmp, w->path) < 0)
+    {
+	unlink(w->tmp);
+	return -1;
+    }
+    return 0;
+}
+
+// This function maps the snapshot at path and indexes its records
+// It returns the number of records, or -1 if there is no valid snapshot there
+int snap_load(const char *path, int32_t *nextmatch, int64_t *when)
+{
+    const struct snaphdr *h;
+    struct stat sb;
+    uint32_t i, j, *bymatch;
+    void *m;
+    int fd;
+    if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0)
+	return -1;
+    if (fstat(fd, &sb) < 0 || (size_t)sb.st_size < sizeof(*h))
+    {
+	close(fd);
+	return -1;
+    }
+    m = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (m == MAP_FAILED)
+	return -1;
+    h = m;
+    if (memcmp(h->magic, SNAPMAGIC, sizeof(h->magic)) ||
+	(size_t)sb.st_size != sizeof(*h) + (size_t)h->n * sizeof(struct snaprec))
+    {
+	munmap(m, sb.st_size);
+	return -1;
+    }
+    recs = (const struct snaprec *)(h + 1);
+    nrecs = h->n;
+    *nextmatch = h->nextmatch;
+    *when = h->when;
+    // Both tables are at least twice the records, so probes stay short
+    for (mask = 15; mask < 2 * nrecs; mask = mask * 2 + 1)
+	;
+    names = calloc(mask + 1, sizeof(*names));
+    bymatch = calloc(mask + 1, sizeof(*bymatch));
+    partner = malloc((nrecs ? nrecs : 1) * sizeof(*partner));
+    claimed = calloc(nrecs ? nrecs : 1, 1);
+    if (!names || !bymatch || !partner || !claimed)
+    {
+	fprintf(stderr, "out of memory!\n");
+	exit(1);
+    }
+    for (i = 0; i < nrecs; i++)
+    {
+	partner[i] = -1;
+	if (memchr(recs[i].name, '\0', SNAPNAME) == NULL)
+	{
+	    claimed[i] = 1; // not a name, nobody can claim it (or be its partner)
+	    continue;
+	}
+	for (j = hash(recs[i].name) & mask; names[j]; j = (j + 1) & mask)
+	    ;
+	names[j] = i + 1;
+	if (recs[i].matchid < 0)
+	    continue;
+	// The first of a match waits in bymatch for the second
+	for (j = (uint32_t)recs[i].matchid * 2654435761u & mask; bymatch[j]; j = (j + 1) & mask)
+	{
+	    if (recs[bymatch[j] - 1].matchid == recs[i].matchid && partner[bymatch[j] - 1] < 0)
+		break;
+	}
+	if (bymatch[j])
+	{
+	    partner[i] = bymatch[j] - 1;
+	    partner[bymatch[j] - 1] = i;
+	}
+	else
+	    bymatch[j] = i + 1;
+    }
+    free(bymatch);
+    return nrecs;
+}
+
+// This function claims the first unclaimed record called name
+// It returns the record, or NULL if there is none (or no snapshot was loaded)
+const struct snaprec *snap_claim(const char *name)
+{
+    const struct snaprec *r = NULL;
+    uint32_t j;
+    if (!names)
+	return NULL;
+    pthread_mutex_lock(&lock);
+    for (j = hash(name) & mask; names[j]; j = (j + 1) & mask)
+    {
+	if (!claimed[names[j] - 1] && !strcmp(recs[names[j] - 1].name, name))
+	{
+	    claimed[names[j] - 1] = 1;
+	    r = &recs[names[j] - 1];
+	    break;
+	}
+    }
+    pthread_mutex_unlock(&lock);
+    return r;
+}
+
+// This function makes r claimable again
+void snap_release(const struct snaprec *r)
+{
+    pthread_mutex_lock(&lock);
+    claimed[r - recs] = 0;
+    pthread_mutex_unlock(&lock);
+}
+
+// This function returns the record of r's opponent, or NULL if r wasn't playing
+const struct snaprec *snap_partner(const struct snaprec *r)
+{
+    int32_t i = partner[r - recs];
+    return i < 0 ? NULL : &recs[i];
+}
+
+// This function returns r's index in the file
+int snap_index(const struct snaprec *r)
+{
+    return r - recs;
+}
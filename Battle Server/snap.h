@@ -0,0 +1,63 @@
+// snap - periodic snapshots of the players and their matches, and reading one back after a crash
+// The server forks every -K seconds, between loop iterations; the child has a copy-on-write
+// image of every shard and writes the named players out while the server carries on.
+// The file is a header and an array of fixed-size records, so reading it back is mapping it:
+// nothing is parsed, only an index on the names (and one pairing each match) is built.
+// A player who comes back with the same name claims its record: its rating and room,
+// and its match if its opponent comes back too.
+//
+// File: struct snaphdr, then n struct snaprec (written to path.tmp and renamed over path)
+#ifndef SNAP_H
+#define SNAP_H
+
+#include <stdint.h>
+
+#define SNAPMAGIC "BSSNAP1" // with its '\0', 8 bytes
+#define SNAPNAME 48 // bytes of name per record, '\0' padded (must be more than MAXNAME)
+#define SNAPBUF 64 // records the writer gathers per write()
+
+struct snaphdr
+{
+    char magic[8]; // SNAPMAGIC
+    uint32_t n; // records that follow
+    int32_t nextmatch; // every match id below this one was used
+    int64_t when; // time() it was taken
+};
+
+// A named player
+struct snaprec
+{
+    char name[SNAPNAME];
+    int32_t rating;
+    int32_t room;
+    int32_t matchid; // the match it was playing, -1 if none
+    int32_t hp, pu; // in that match
+    uint8_t turn, pad[3]; // 1 if it was its move
+    uint64_t dice[2]; // its generator's state and increment
+};
+
+// A snapshot being written, by the child (nothing is allocated)
+struct snapw
+{
+    int fd; // path.tmp
+    int nbuf; // records in buf
+    int err; // 1 once a write failed
+    uint32_t n; // records written
+    const char *path;
+    char tmp[4096];
+    struct snaprec buf[SNAPBUF];
+};
+
+//============================================
+// Function Prototypes
+//============================================
+int snap_open(struct snapw *w, const char *path); // start writing path.tmp, -1 on error
+void snap_add(struct snapw *w, const struct snaprec *r); // append a record
+int snap_close(struct snapw *w, int32_t nextmatch); // write the header and rename over path, -1 on error
+int snap_load(const char *path, int32_t *nextmatch, int64_t *when); // map path and index it, returns the records or -1
+const struct snaprec *snap_claim(const char *name); // an unclaimed record called name, claimed now, or NULL
+void snap_release(const struct snaprec *r); // give a claim back, for the next one to come with that name
+const struct snaprec *snap_partner(const struct snaprec *r); // the opponent's record in r's match, or NULL
+int snap_index(const struct snaprec *r); // r's position in the file
+
+#endif
@@ -0,0 +1,109 @@
+// Snapshot formatting for the battleserver's stats listener
+// The shards keep counting while a snapshot is taken, so the numbers of different
+// shards may be a loop iteration apart; each counter is written by one thread only.
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include "stats.h"
+
+// This function returns the monotonic time in nanoseconds
+uint64_t stats_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// This function appends one histogram line to buf
+static size_t printhist(char *buf, size_t size, const char *name, const struct hist *h)
+{
+    int n = snprintf(buf, size, "%-6s n %lu mean %lu p50 %lu p90 %lu p99 %lu p99.9 %lu max %lu\n",
+	    name, (unsigned long)h->n, (unsigned long)(h->n ? h->sum / h->n : 0),
+	    (unsigned long)hist_pct(h, 50), (unsigned long)hist_pct(h, 90),
+	    (unsigned long)hist_pct(h, 99), (unsigned long)hist_pct(h, 99.9),
+	    (unsigned long)h->max);
+    return n < 0 ? 0 : ((size_t)n < size ? (size_t)n : size - 1);
+}
+
+// This function appends the counters of s to buf, labelled with name
+static size_t printcounters(char *buf, size_t size, const char *name, const struct stats *s)
+{
+    int n = snprintf(buf, size,
+	    "%s: connected %lu waiting %lu watching %lu matches %lu"
+	    " accepts %lu closes %lu bytesin %lu bytesout %lu lines %lu turns %lu"
+	    " started %lu finished %lu overflows %lu timeouts %lu handedout %lu handedin %lu"
+	    " frames %lu skipped %lu snapshots %lu rejected %lu shed %lu flooded %lu"
+	    " loops %lu waitms %lu busyms %lu\n",
+	    name, (unsigned long)s->connected, (unsigned long)s->waiting, (unsigned long)s->watching,
+	    (unsigned long)(s->started - s->finished),
+	    (unsigned long)s->accepts, (unsigned long)s->closes,
+	    (unsigned long)s->bytesin, (unsigned long)s->bytesout,
+	    (unsigned long)s->lines, (unsigned long)s->turns,
+	    (unsigned long)s->started, (unsigned long)s->finished, (unsigned long)s->overflows,
+	    (unsigned long)s->timeouts,
+	    (unsigned long)s->handedout, (unsigned long)s->handedin,
+	    (unsigned long)s->frames, (unsigned long)s->skipped, (unsigned long)s->snapshots,
+	    (unsigned long)s->rejected, (unsigned long)s->shed, (unsigned long)s->flooded,
+	    (unsigned long)s->loops, (unsigned long)(s->waitns / 1000000),
+	    (unsigned long)(s->busyns / 1000000));
+    return n < 0 ? 0 : ((size_t)n < size ? (size_t)n : size - 1);
+}
+
+// This function formats a snapshot of the n shards' stats into buf:
+// one line of counters per shard, their total, and the merged latency histograms
+// It returns the length of the text (truncated to fit size)
+size_t stats_print(char *buf, size_t size, struct stats **s, int n)
+{
+    static struct stats total; // only the stats listener's thread calls this
+    char name[24];
+    size_t len = 0;
+    int i;
+    memset(&total, 0, sizeof(total));
+    for (i = 0; i < n; i++)
+    {
+	if (!s[i])
+	    continue; // shard not started yet
+	snprintf(name, sizeof(name), "shard %d", i);
+	len += printcounters(buf + len, size - len, name, s[i]);
+	total.accepts += s[i]->accepts;
+	total.closes += s[i]->closes;
+	total.bytesin += s[i]->bytesin;
+	total.bytesout += s[i]->bytesout;
+	total.lines += s[i]->lines;
+	total.turns += s[i]->turns;
+	total.started += s[i]->started;
+	total.finished += s[i]->finished;
+	total.overflows += s[i]->overflows;
+	total.timeouts += s[i]->timeouts;
+	total.handedout += s[i]->handedout;
+	total.handedin += s[i]->handedin;
+	total.frames += s[i]->frames;
+	total.skipped += s[i]->skipped;
+	total.snapshots += s[i]->snapshots;
+	total.rejected += s[i]->rejected;
+	total.shed += s[i]->shed;
+	total.flooded += s[i]->flooded;
+	total.loops += s[i]->loops;
+	total.waitns += s[i]->waitns;
+	total.busyns += s[i]->busyns;
+	total.connected += s[i]->connected;
+	total.waiting += s[i]->waiting;
+	total.watching += s[i]->watching;
+	hist_merge(&total.accept, &s[i]->accept);
+	hist_merge(&total.parse, &s[i]->parse);
+	hist_merge(&total.turn, &s[i]->turn);
+	hist_merge(&total.flush, &s[i]->flush);
+	hist_merge(&total.fork, &s[i]->fork);
+    }
+    len += printcounters(buf + len, size - len, "total", &total);
+    len += snprintf(buf + len, size - len, "latency (ns):\n");
+    if (len >= size)
+	return size - 1;
+    len += printhist(buf + len, size - len, "accept", &total.accept);
+    len += printhist(buf + len, size - len, "parse", &total.parse);
+    len += printhist(buf + len, size - len, "turn", &total.turn);
+    len += printhist(buf + len, size - len, "flush", &total.flush);
+    if (total.fork.n) // only with -k
+	len += printhist(buf + len, size - len, "fork", &total.fork);
+    return len;
+}
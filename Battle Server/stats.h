@@ -0,0 +1,53 @@
+// stats - per-shard counters and latency histograms for the battleserver
+// Each shard only ever writes its own struct stats (plain increments, no locks or atomics),
+// the stats listener reads all of them to print a snapshot
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "hist.h"
+
+struct stats
+{
+    // Counters
+    uint64_t accepts; // connections accepted
+    uint64_t closes; // connections closed
+    uint64_t bytesin; // bytes read from clients
+    uint64_t bytesout; // bytes written to clients
+    uint64_t lines; // lines parsed
+    uint64_t turns; // attacks and power moves played
+    uint64_t started; // matches started
+    uint64_t finished; // matches ended (a win or a drop)
+    uint64_t overflows; // clients dropped for passing the high-water mark
+    uint64_t timeouts; // deadlines missed (name, turn or idle)
+    uint64_t handedout; // clients sent to another shard
+    uint64_t handedin; // clients received from another shard
+    uint64_t frames; // battle events rendered for spectators
+    uint64_t skipped; // frames a spectator skipped for being behind
+    uint64_t snapshots; // snapshots forked (shard 0)
+    uint64_t rejected; // connections closed on arrival for passing the cap
+    uint64_t shed; // lines dropped for passing a client's rate
+    uint64_t flooded; // clients disconnected for sending lines too fast for too long
+    uint64_t loops; // game loop iterations
+    uint64_t waitns; // time spent in reactor_wait()
+    uint64_t busyns; // time spent handling events
+    // Gauges, updated at the end of every loop iteration
+    uint64_t connected; // clients on the shard
+    uint64_t waiting; // clients on the ready queue
+    uint64_t watching; // clients watching a battle
+    // Latencies in nanoseconds
+    struct hist accept; // newconnection()
+    struct hist parse; // frame one line
+    struct hist turn; // play one attack or power move
+    struct hist flush; // flushall()
+    struct hist fork; // the shards stopped for a snapshot, from the first to stop to fork() returning
+};
+
+//============================================
+// Function Prototypes
+//============================================
+uint64_t stats_now(void); // monotonic nanoseconds (clock_gettime() is served by the vDSO, no system call)
+size_t stats_print(char *buf, size_t size, struct stats **s, int n); // format a snapshot of n shards into buf
+
+#endif
@@ -0,0 +1,178 @@
+// Hierarchical timing wheel for the battleserver's deadlines
+// A timer goes on the lowest level whose slot span still separates it from now:
+// if its expiry and now only differ in the low 6 bits it goes on level 0, in the low
+// 12 bits on level 1, and so on. When the wheel reaches the start of a slot on a higher
+// level, that slot's timers are placed again, which moves each one at least a level down.
+#include <stddef.h>
+#include "timer.h"
+
+#define MASK (WHEEL_SLOTS - 1)
+// Farther than this and a top level slot could come round twice before the timer fires
+#define MAXTICKS ((uint64_t)MASK << (WHEEL_BITS * (WHEEL_LEVELS - 1)))
+
+// This function puts t in the slot for t->expires (which is after w->now)
+static void place(struct wheel *w, struct timer *t)
+{
+    uint64_t diff = t->expires ^ w->now; // the bits where the expiry and now differ
+    int level = 0, i;
+    while (level < WHEEL_LEVELS - 1 && (diff >> (WHEEL_BITS * (level + 1))))
+	level++;
+    i = (t->expires >> (WHEEL_BITS * level)) & MASK;
+    t->level = level;
+    t->i = i;
+    t->prev = NULL;
+    t->next = w->slot[level][i];
+    if (t->next)
+	t->next->prev = t;
+    w->slot[level][i] = t;
+    w->used[level] |= 1ULL << i;
+}
+
+// This function takes t out of its slot
+static void unplace(struct wheel *w, struct timer *t)
+{
+    if (t->next)
+	t->next->prev = t->prev;
+    if (t->prev)
+	t->prev->next = t->next;
+    else
+    {
+	w->slot[t->level][t->i] = t->next;
+	if (!t->next)
+	    w->used[t->level] &= ~(1ULL << t->i);
+    }
+}
+
+// This function empties the wheel, its current tick is now
+void wheel_init(struct wheel *w, uint64_t now)
+{
+    int l, i;
+    for (l = 0; l < WHEEL_LEVELS; l++)
+    {
+	for (i = 0; i < WHEEL_SLOTS; i++)
+	    w->slot[l][i] = NULL;
+	w->used[l] = 0;
+    }
+    w->now = now;
+    w->n = 0;
+}
+
+// This function makes t a disarmed timer that calls fn when it fires
+void timer_init(struct timer *t, void (*fn)(struct timer *t))
+{
+    t->prev = t->next = NULL;
+    t->expires = 0;
+    t->fn = fn;
+    t->armed = 0;
+}
+
+// This function arms t to fire ticks after the wheel's current tick (at least 1)
+// If t was armed already, the old expiry is forgotten
+void timer_arm(struct wheel *w, struct timer *t, uint64_t ticks)
+{
+    if (t->armed)
+	timer_cancel(w, t);
+    if (ticks < 1)
+	ticks = 1; // the current tick has run
+    if (ticks > MAXTICKS)
+	ticks = MAXTICKS;
+    t->expires = w->now + ticks;
+    place(w, t);
+    t->armed = 1;
+    w->n++;
+}
+
+// This function disarms t
+void timer_cancel(struct wheel *w, struct timer *t)
+{
+    if (!t->armed)
+	return;
+    unplace(w, t);
+    t->prev = t->next = NULL;
+    t->armed = 0;
+    w->n--;
+}
+
+// This function runs tick w->now + 1: higher level slots that start on it are cascaded,
+// then the level 0 timers due on it fire
+// It returns how many fired
+static int tick(struct wheel *w)
+{
+    struct timer *t, *next;
+    int l, i, fired = 0;
+    w->now++;
+    for (l = WHEEL_LEVELS - 1; l > 0; l--)
+    {
+	if (w->now & ((1ULL << (WHEEL_BITS * l)) - 1))
+	    continue; // not the start of a slot on this level
+	i = (w->now >> (WHEEL_BITS * l)) & MASK;
+	t = w->slot[l][i];
+	w->slot[l][i] = NULL;
+	w->used[l] &= ~(1ULL << i);
+	for (; t; t = next)
+	{
+	    next = t->next;
+	    place(w, t); // on a lower level now
+	}
+    }
+    // A callback may cancel or arm other timers (even ones in this slot),
+    // so the slot is emptied one timer at a time
+    i = w->now & MASK;
+    while ((t = w->slot[0][i]))
+    {
+	unplace(w, t);
+	t->prev = t->next = NULL;
+	t->armed = 0;
+	w->n--;
+	fired++;
+	t->fn(t);
+    }
+    return fired;
+}
+
+// This function runs the wheel up to tick now, firing every timer due by then
+// Stretches of ticks with nothing to do are skipped
+int wheel_advance(struct wheel *w, uint64_t now)
+{
+    int64_t next;
+    int fired = 0;
+    while (w->now < now)
+    {
+	next = wheel_next(w);
+	if (next < 0 || (uint64_t)next > now - w->now)
+	{
+	    w->now = now; // nothing due by then
+	    break;
+	}
+	w->now += next - 1;
+	fired += tick(w);
+    }
+    return fired;
+}
+
+// This function returns how many ticks from now the wheel has something to do
+// (fire a level 0 slot or cascade a higher one), or -1 if no timer is armed
+// It is found from the occupied-slot bitmaps, one lookup per level
+int64_t wheel_next(const struct wheel *w)
+{
+    uint64_t best = UINT64_MAX, at, base, later;
+    int l, shift, cur;
+    if (!w->n)
+	return -1;
+    for (l = 0; l < WHEEL_LEVELS; l++)
+    {
+	if (!w->used[l])
+	    continue;
+	shift = WHEEL_BITS * l;
+	cur = (w->now >> shift) & MASK; // the slot now is in
+	base = w->now >> (shift + WHEEL_BITS) << (shift + WHEEL_BITS); // where this level's slots start
+	later = cur == MASK ? 0 : w->used[l] & ~((2ULL << cur) - 1); // slots after cur
+	if (later)
+	    at = base + ((uint64_t)__builtin_ctzll(later) << shift);
+	else // only the top level wraps round
+	    at = base + ((uint64_t)(WHEEL_SLOTS + __builtin_ctzll(w->used[l])) << shift);
+	if (at < best)
+	    best = at;
+    }
+    return (int64_t)(best - w->now);
+}
@@ -0,0 +1,44 @@
+// timer - hierarchical timing wheel
+// Arming and cancelling a timer is O(1) (a list insert or unlink), and advancing the wheel
+// only looks at the slots whose time has come, never at every armed timer.
+// Level 0 has one slot per tick; each level above has slots 64 times as wide,
+// and a slot's timers are moved down a level (cascaded) when the wheel reaches it.
+// A wheel belongs to one thread (one per shard), nothing is locked.
+#ifndef TIMER_H
+#define TIMER_H
+
+#include <stdint.h>
+
+#define WHEEL_BITS 6 // 64 slots per level
+#define WHEEL_SLOTS (1 << WHEEL_BITS)
+#define WHEEL_LEVELS 4 // 64^4 ticks, about 46 hours with 10 ms ticks
+
+// Embed this in whatever the timer is for, fn gets it back when it fires
+struct timer
+{
+    struct timer *prev, *next; // position in its slot
+    uint64_t expires; // the tick it fires on
+    void (*fn)(struct timer *t); // called once when it fires (it is disarmed by then)
+    unsigned char level, i; // the slot it is in
+    unsigned char armed; // 1 while in the wheel
+};
+
+struct wheel
+{
+    uint64_t now; // the last tick run
+    struct timer *slot[WHEEL_LEVELS][WHEEL_SLOTS]; // timers per slot, unordered
+    uint64_t used[WHEEL_LEVELS]; // bit i set if slot i of that level has timers
+    int n; // timers armed
+};
+
+//============================================
+// Function Prototypes
+//============================================
+void wheel_init(struct wheel *w, uint64_t now); // empty the wheel, starting at tick now
+void timer_init(struct timer *t, void (*fn)(struct timer *t)); // a disarmed timer calling fn
+void timer_arm(struct wheel *w, struct timer *t, uint64_t ticks); // fire ticks from now (rearms if armed)
+void timer_cancel(struct wheel *w, struct timer *t); // disarm t, harmless if not armed
+int wheel_advance(struct wheel *w, uint64_t now); // fire every timer due by tick now, returns how many
+int64_t wheel_next(const struct wheel *w); // ticks until a timer may be due, -1 if none is armed
+
+#endif
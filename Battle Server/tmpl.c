@@ -0,0 +1,92 @@
+// Message templates for the battleserver
+// The formats are the same strings the server used to sprintf(), so the text on the wire
+// doesn't change; only %s and %d are understood.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "tmpl.h"
+
+// "00" to "99", so numbers are written two digits at a time
+static const char digits[] =
+	"00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+	"40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+	"8081828384858687888990919293949596979899";
+
+// This function compiles fmt into t, each %s hole taking at most maxarg bytes
+void tmpl_compile(struct tmpl *t, const char *fmt, int maxarg)
+{
+    const char *p = fmt;
+    int n = 0;
+    t->lit[0] = p;
+    t->max = 0;
+    while ((p = strchr(p, '%')))
+    {
+	if (p[1] != 's' && p[1] != 'd')
+	{
+	    fprintf(stderr, "tmpl: bad format \"%s\"\n", fmt);
+	    exit(1);
+	}
+	if (n == TMPL_HOLES)
+	{
+	    fprintf(stderr, "tmpl: more than %d holes in \"%s\"\n", TMPL_HOLES, fmt);
+	    exit(1);
+	}
+	t->litlen[n] = p - t->lit[n];
+	t->kind[n] = p[1];
+	t->max += t->litlen[n] + (p[1] == 's' ? maxarg : TMPL_INTLEN);
+	n++;
+	p += 2;
+	t->lit[n] = p;
+    }
+    t->litlen[n] = strlen(t->lit[n]);
+    t->max += t->litlen[n];
+    t->holes = n;
+}
+
+// This function writes the decimal digits of v at out and returns the end
+char *tmpl_itoa(char *out, int v)
+{
+    char buf[TMPL_INTLEN];
+    char *p = buf + sizeof(buf);
+    unsigned int u = v < 0 ? 0u - (unsigned int)v : (unsigned int)v;
+    while (u >= 100)
+    {
+	p -= 2;
+	memcpy(p, digits + (u % 100) * 2, 2);
+	u /= 100;
+    }
+    if (u >= 10)
+    {
+	p -= 2;
+	memcpy(p, digits + u * 2, 2);
+    }
+    else
+	*--p = '0' + u;
+    if (v < 0)
+	*--p = '-';
+    memcpy(out, p, buf + sizeof(buf) - p);
+    return out + (buf + sizeof(buf) - p);
+}
+
+// This function renders t with the arguments a into out, which has room for t->max bytes
+// It returns the number of bytes written (out is not '\0' terminated)
+size_t tmpl_render(const struct tmpl *t, char *out, const struct targ *a)
+{
+    char *o = out;
+    int i;
+    for (i = 0; i < t->holes; i++)
+    {
+	memcpy(o, t->lit[i], t->litlen[i]);
+	o += t->litlen[i];
+	if (t->kind[i] == 's')
+	{
+	    memcpy(o, a[i].s, a[i].len);
+	    o += a[i].len;
+	}
+	else
+	    o = tmpl_itoa(o, a[i].d);
+    }
+    memcpy(o, t->lit[i], t->litlen[i]);
+    o += t->litlen[i];
+    return o - out;
+}
@@ -0,0 +1,39 @@
+// tmpl - message templates compiled once at startup
+// A printf-style format with %s and %d holes is split into its literal pieces (with their
+// lengths) when the server starts; rendering copies those pieces and splices in the
+// arguments, with no format parsing, no strlen() and a table-driven itoa for the numbers
+#ifndef TMPL_H
+#define TMPL_H
+
+#include <stddef.h>
+
+#define TMPL_HOLES 4 // most holes in one template
+#define TMPL_INTLEN 11 // longest int, "-2147483648"
+
+struct tmpl
+{
+    int holes; // number of %s and %d holes
+    const char *lit[TMPL_HOLES + 1]; // the literal before each hole, and the one after the last
+    int litlen[TMPL_HOLES + 1];
+    char kind[TMPL_HOLES]; // 's' or 'd'
+    int max; // longest rendering, with each %s at most maxarg bytes
+};
+
+// One argument for a hole: a string of known length or an int
+struct targ
+{
+    const char *s; // for %s
+    int len; // length of s
+    int d; // for %d
+};
+#define TSTR(str, n) { (str), (n), 0 }
+#define TINT(v) { NULL, 0, (v) }
+
+//============================================
+// Function Prototypes
+//============================================
+void tmpl_compile(struct tmpl *t, const char *fmt, int maxarg); // split fmt, which must outlive t (aborts on a bad format)
+size_t tmpl_render(const struct tmpl *t, char *out, const struct targ *a); // write t with a into out (t->max bytes), returns the length
+char *tmpl_itoa(char *out, int v); // write v in decimal, returns the end (no '\0')
+
+#endif
@@ -0,0 +1,255 @@
+// Hot upgrade transport for the battleserver
+// The two processes talk over a SOCK_SEQPACKET socket, so every message arrives whole:
+// first the sizes, then the descriptors UPFDS at a time (with a byte of data each, since
+// they ride on a message), then the snapshot in UPCHUNK byte pieces, then one byte back
+// from the new process once it holds everything.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include "upgrade.h"
+
+#define UPFDS 250 // descriptors per message (the kernel takes at most 253)
+#define UPCHUNK 32768 // snapshot bytes per message
+
+// The first message
+struct upsizes
+{
+    uint64_t len; // snapshot bytes
+    uint32_t nfds; // descriptors
+};
+
+// This function fills in the address of path, returns -1 if it is too long
+static int addr(struct sockaddr_un *a, const char *path)
+{
+    memset(a, 0, sizeof(*a));
+    a->sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(a->sun_path))
+    {
+	errno = ENAMETOOLONG;
+	return -1;
+    }
+    strcpy(a->sun_path, path);
+    return 0;
+}
+
+// This function gives s a timeout, so a peer that stops answering fails the upgrade
+static void timeouts(int s)
+{
+    struct timeval tv = { UPTIMEOUT, 0 };
+    setsockopt(s, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(s, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+}
+
+// This function listens on the UNIX socket path, removing whatever socket was left there
+// It returns the listener, or -1 on error
+int upgrade_listen(const char *path)
+{
+    struct sockaddr_un a;
+    int s;
+    if (addr(&a, path) < 0)
+	return -1;
+    if ((s = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) < 0)
+	return -1; // non-blocking, the reactor says when to accept
+    unlink(path);
+    if (bind(s, (struct sockaddr *)&a, sizeof(a)) < 0 || listen(s, 1) < 0)
+    {
+	close(s);
+	return -1;
+    }
+    return s;
+}
+
+// This function connects to a server listening on path
+// It returns the connection, or -1 if nobody listens there (a fresh start)
+int upgrade_connect(const char *path)
+{
+    struct sockaddr_un a;
+    int s;
+    if (addr(&a, path) < 0)
+	return -1;
+    if ((s = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0)) < 0)
+	return -1;
+    if (connect(s, (struct sockaddr *)&a, sizeof(a)) < 0)
+    {
+	close(s);
+	return -1;
+    }
+    timeouts(s);
+    return s;
+}
+
+// This function appends n bytes from p to b
+void upbuf_add(struct upbuf *b, const void *p, size_t n)
+{
+    if (b->len + n > b->cap)
+    {
+	size_t newcap = b->cap ? b->cap : 4096;
+	while (newcap < b->len + n)
+	    newcap *= 2; // double until it fits
+	char *t = realloc(b->data, newcap);
+	if (!t)
+	{
+	    fprintf(stderr, "out of memory!\n");
+	    exit(1);
+	}
+	b->data = t;
+	b->cap = newcap;
+    }
+    memcpy(b->data + b->len, p, n);
+    b->len += n;
+}
+
+// This function appends fd to b's descriptors
+void upbuf_addfd(struct upbuf *b, int fd)
+{
+    if (b->nfds == b->fdcap)
+    {
+	int newcap = b->fdcap ? b->fdcap * 2 : 256;
+	int *t = realloc(b->fds, newcap * sizeof(*t));
+	if (!t)
+	{
+	    fprintf(stderr, "out of memory!\n");
+	    exit(1);
+	}
+	b->fds = t;
+	b->fdcap = newcap;
+    }
+    b->fds[b->nfds++] = fd;
+}
+
+// This function empties b (the descriptors are not closed)
+void upbuf_free(struct upbuf *b)
+{
+    free(b->data);
+    free(b->fds);
+    memset(b, 0, sizeof(*b));
+}
+
+// This function sends one message of n bytes with nfds descriptors
+static int sendone(int s, const void *p, size_t n, const int *fds, int nfds)
+{
+    char cbuf[CMSG_SPACE(UPFDS * sizeof(int))];
+    struct iovec iov = { (void *)p, n };
+    struct msghdr m;
+    struct cmsghdr *c;
+    memset(&m, 0, sizeof(m));
+    m.msg_iov = &iov;
+    m.msg_iovlen = 1;
+    if (nfds)
+    {
+	memset(cbuf, 0, sizeof(cbuf));
+	m.msg_control = cbuf;
+	m.msg_controllen = CMSG_SPACE(nfds * sizeof(int));
+	c = CMSG_FIRSTHDR(&m);
+	c->cmsg_level = SOL_SOCKET;
+	c->cmsg_type = SCM_RIGHTS;
+	c->cmsg_len = CMSG_LEN(nfds * sizeof(int));
+	memcpy(CMSG_DATA(c), fds, nfds * sizeof(int));
+    }
+    return sendmsg(s, &m, MSG_NOSIGNAL) == (ssize_t)n ? 0 : -1;
+}
+
+// This function sends b over s and waits for the new process to say it has it all
+// The descriptors stay open here, so if anything fails the old process can carry on
+// It returns 0 on success, -1 on error
+int upgrade_send(int s, const struct upbuf *b)
+{
+    struct upsizes z = { b->len, b->nfds };
+    size_t off;
+    int i, n;
+    char ack;
+    timeouts(s);
+    if (sendone(s, &z, sizeof(z), NULL, 0) < 0)
+	return -1;
+    for (i = 0; i < b->nfds; i += n)
+    {
+	n = b->nfds - i < UPFDS ? b->nfds - i : UPFDS;
+	if (sendone(s, "F", 1, b->fds + i, n) < 0)
+	    return -1;
+    }
+    for (off = 0; off < b->len; off += n)
+    {
+	n = b->len - off < UPCHUNK ? b->len - off : UPCHUNK;
+	if (sendone(s, b->data + off, n, NULL, 0) < 0)
+	    return -1;
+    }
+    if ((n = read(s, &ack, 1)) != 1)
+    {
+	if (n == 0)
+	    errno = EPIPE; // the new process went away
+	return -1;
+    }
+    return 0;
+}
+
+// This function receives a snapshot and its descriptors into b (which must be empty)
+// The old process waits for upgrade_ack() before it lets go of anything
+// It returns 0, or -1 on error (the descriptors received so far are closed)
+int upgrade_recv(int s, struct upbuf *b)
+{
+    char cbuf[CMSG_SPACE(UPFDS * sizeof(int))];
+    struct upsizes z;
+    struct msghdr m;
+    struct iovec iov;
+    struct cmsghdr *c;
+    char one;
+    ssize_t n;
+    int i, k;
+    if (recv(s, &z, sizeof(z), 0) != sizeof(z))
+	return -1;
+    // The descriptors
+    while ((uint32_t)b->nfds < z.nfds)
+    {
+	memset(&m, 0, sizeof(m));
+	iov.iov_base = &one;
+	iov.iov_len = 1;
+	m.msg_iov = &iov;
+	m.msg_iovlen = 1;
+	m.msg_control = cbuf;
+	m.msg_controllen = sizeof(cbuf);
+	if (recvmsg(s, &m, MSG_CMSG_CLOEXEC) != 1 || (m.msg_flags & MSG_CTRUNC))
+	    goto fail;
+	for (c = CMSG_FIRSTHDR(&m); c; c = CMSG_NXTHDR(&m, c))
+	{
+	    if (c->cmsg_level != SOL_SOCKET || c->cmsg_type != SCM_RIGHTS)
+		continue;
+	    k = (c->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+	    for (i = 0; i < k; i++)
+	    {
+		int fd;
+		memcpy(&fd, CMSG_DATA(c) + i * sizeof(int), sizeof(int));
+		upbuf_addfd(b, fd);
+	    }
+	}
+    }
+    // The snapshot
+    if (!(b->data = malloc(z.len ? z.len : 1)))
+	goto fail;
+    b->cap = z.len;
+    while (b->len < z.len)
+    {
+	if ((n = recv(s, b->data + b->len, z.len - b->len, 0)) <= 0)
+	    goto fail;
+	b->len += n;
+    }
+    if ((uint32_t)b->nfds != z.nfds)
+	goto fail;
+    return 0;
+fail:
+    for (i = 0; i < b->nfds; i++)
+	close(b->fds[i]);
+    upbuf_free(b);
+    return -1;
+}
+
+// This function tells the old process that everything arrived, so it can exit
+// It returns 0, or -1 if the old process is gone (it gave up waiting and carries on)
+int upgrade_ack(int s)
+{
+    return write(s, "K", 1) == 1 ? 0 : -1;
+}
@@ -0,0 +1,69 @@
+// upgrade - hands a running server's sockets and clients over to a new server process
+// With -U path a server listens on the UNIX socket path. A new server started with the same
+// -U connects to it, and the old one sends its listeners and every client's socket
+// (SCM_RIGHTS) along with a snapshot of the clients, then exits once the new one has them.
+// Nobody is disconnected: the new process carries on every match where it was.
+//
+// Snapshot: struct uphdr, then a struct upclient per client followed by its name,
+// its buffered input and its unsent output
+// Descriptors: the listeners, the stats listener if any, then one per client in the same order
+#ifndef UPGRADE_H
+#define UPGRADE_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define UPMAGIC 0x50555342 // "BSUP"
+#define UPVERSION 1
+#define UPTIMEOUT 10 // seconds either side waits for the other before giving up
+
+struct uphdr
+{
+    uint32_t magic; // UPMAGIC
+    uint32_t version; // UPVERSION, both processes must agree on struct upclient
+    uint32_t nlisten; // listeners, one per shard
+    uint32_t nstats; // 1 if the stats listener follows them
+    uint32_t nclients; // records that follow
+    int32_t nextmatch; // every match id below this one was used
+};
+
+// One client, as the old process had it
+struct upclient
+{
+    int32_t fd; // its fd in the old process, which nowfd, lastfd and watching refer to
+    int32_t nowfd; // the opponent, -5 if not playing
+    int32_t lastfd; // the last opponent, -5 if none
+    int32_t watching; // the player it watches, -1 if none
+    int32_t hp, pu;
+    int32_t rating;
+    int32_t room; // -1 if not named yet
+    int32_t matchid;
+    uint8_t turn, yell, ready, pad;
+    uint64_t dice[2]; // the state and increment of its generator
+    uint64_t deadline; // the tick its deadline fires on, 0 if not armed
+    uint64_t heard, since; // ticks, CLOCK_MONOTONIC is the same in both processes
+    uint32_t namelen, inlen, outlen; // bytes of each that follow the record
+};
+
+// Snapshot bytes and the descriptors that go with them, both grown as they are added
+struct upbuf
+{
+    char *data;
+    size_t len, cap;
+    int *fds;
+    int nfds, fdcap;
+};
+
+//============================================
+// Function Prototypes
+//============================================
+int upgrade_listen(const char *path); // listen on path (replacing a stale socket), -1 on error
+int upgrade_connect(const char *path); // connect to the server on path, -1 if there is none
+void upbuf_add(struct upbuf *b, const void *p, size_t n); // append n bytes
+void upbuf_addfd(struct upbuf *b, int fd); // append a descriptor
+void upbuf_free(struct upbuf *b); // empty b and free its memory
+int upgrade_send(int s, const struct upbuf *b); // send b, returns 0 once the new process has it all
+int upgrade_recv(int s, struct upbuf *b); // receive b, -1 on error
+int upgrade_ack(int s); // tell the old process b arrived whole, -1 if it is gone
+
+#endif
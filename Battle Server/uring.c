@@ -0,0 +1,316 @@
+// A minimal io_uring driver on the raw system calls (no liburing needed)
+// The submission and completion rings are shared with the kernel through mmap();
+// the only system call in the loop is io_uring_enter(), once per uring_wait().
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "uring.h"
+
+#if defined(__linux__) && !defined(NO_URING)
+#include <unistd.h>
+#include <signal.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#define SQSIZE 512 // submission queue entries
+#define CQSIZE 4096 // completion queue entries (multishot operations complete many times)
+#define NBUFS 512 // provided receive buffers, a power of two
+#define BUFSIZE 1024 // bytes per receive buffer
+#define BGID 0 // the buffer group receives pick from
+
+// This shard's ring (one per thread)
+static __thread struct
+{
+    int fd; // the io_uring instance, -1 if none
+    // Submission queue
+    unsigned int *sqhead, *sqtail, sqmask, *sqarray;
+    struct io_uring_sqe *sqes;
+    unsigned int sqlocal; // our tail, published to the kernel by uring_wait()
+    unsigned int tosubmit; // entries queued since the last io_uring_enter()
+    // Completion queue
+    unsigned int *cqhead, *cqtail, cqmask;
+    struct io_uring_cqe *cqes;
+    // Provided buffers for receives
+    struct io_uring_buf_ring *br;
+    char *bufs;
+} u = { -1 };
+
+// This function wraps the system calls, glibc has no wrappers for them
+static int enter(unsigned int submit, unsigned int wait, unsigned int flags, void *arg, size_t argsz)
+{
+    return (int)syscall(__NR_io_uring_enter, u.fd, submit, wait, flags, arg, argsz);
+}
+
+// This function returns 1 if the kernel supports op
+// The newest operation used here, multishot receive, came with IORING_OP_SEND_ZC (6.0)
+static int supported(int op)
+{
+    size_t size = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe *p = calloc(1, size);
+    int ok;
+    if (!p)
+	return 0;
+    ok = syscall(__NR_io_uring_register, u.fd, IORING_REGISTER_PROBE, p, 256) == 0 &&
+	op <= p->last_op && (p->ops[op].flags & IO_URING_OP_SUPPORTED);
+    free(p);
+    return ok;
+}
+
+// This function creates this thread's ring, maps it and registers the receive buffers
+// It returns 0, or -1 if the kernel has no (or too old an) io_uring
+int uring_init(void)
+{
+    struct io_uring_params p;
+    struct io_uring_buf_reg reg;
+    char *sq, *cq;
+    int i;
+    if (u.fd >= 0)
+	return 0; // this thread already has one
+    memset(&p, 0, sizeof(p));
+    p.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN;
+    p.cq_entries = CQSIZE;
+    if ((u.fd = syscall(__NR_io_uring_setup, SQSIZE, &p)) < 0 && errno == EINVAL)
+    {
+	// Before 6.1: no DEFER_TASKRUN, completions are run as the kernel likes
+	memset(&p, 0, sizeof(p));
+	p.flags = IORING_SETUP_CQSIZE;
+	p.cq_entries = CQSIZE;
+	u.fd = syscall(__NR_io_uring_setup, SQSIZE, &p);
+    }
+    if (u.fd < 0)
+	return -1; // ENOSYS, or disabled by the administrator (EPERM)
+    if (!(p.features & IORING_FEAT_SINGLE_MMAP) || !(p.features & IORING_FEAT_NODROP) ||
+	!supported(IORING_OP_SEND_ZC))
+    {
+	close(u.fd);
+	u.fd = -1;
+	errno = ENOSYS;
+	return -1;
+    }
+    // The submission and completion rings share one mapping (IORING_FEAT_SINGLE_MMAP)
+    size_t sqsz = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+    size_t cqsz = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    size_t sz = sqsz > cqsz ? sqsz : cqsz;
+    sq = mmap(NULL, sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u.fd, IORING_OFF_SQ_RING);
+    u.sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+	    MAP_SHARED | MAP_POPULATE, u.fd, IORING_OFF_SQES);
+    if (sq == MAP_FAILED || u.sqes == MAP_FAILED)
+    {
+	perror("io_uring mmap");
+	exit(1);
+    }
+    cq = sq;
+    u.sqhead = (unsigned int *)(sq + p.sq_off.head);
+    u.sqtail = (unsigned int *)(sq + p.sq_off.tail);
+    u.sqmask = *(unsigned int *)(sq + p.sq_off.ring_mask);
+    u.sqarray = (unsigned int *)(sq + p.sq_off.array);
+    u.sqlocal = *u.sqtail;
+    u.cqhead = (unsigned int *)(cq + p.cq_off.head);
+    u.cqtail = (unsigned int *)(cq + p.cq_off.tail);
+    u.cqmask = *(unsigned int *)(cq + p.cq_off.ring_mask);
+    u.cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+    // Receive buffers: the kernel takes one from the ring for each piece it receives
+    u.br = mmap(NULL, NBUFS * sizeof(struct io_uring_buf), PROT_READ | PROT_WRITE,
+	    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (u.br == MAP_FAILED || !(u.bufs = malloc((size_t)NBUFS * BUFSIZE)))
+    {
+	fprintf(stderr, "out of memory!\n");
+	exit(1);
+    }
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t)(uintptr_t)u.br;
+    reg.ring_entries = NBUFS;
+    reg.bgid = BGID;
+    if (syscall(__NR_io_uring_register, u.fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+    {
+	close(u.fd);
+	u.fd = -1;
+	return -1;
+    }
+    for (i = 0; i < NBUFS; i++)
+    {
+	struct io_uring_buf *b = &u.br->bufs[i];
+	b->addr = (uint64_t)(uintptr_t)(u.bufs + (size_t)i * BUFSIZE);
+	b->len = BUFSIZE;
+	b->bid = i;
+    }
+    __atomic_store_n(&u.br->tail, NBUFS, __ATOMIC_RELEASE);
+    return 0;
+}
+
+// This function returns a cleared submission entry, submitting the queue first if it is full
+static struct io_uring_sqe *getsqe(void)
+{
+    struct io_uring_sqe *sqe;
+    if (u.sqlocal - __atomic_load_n(u.sqhead, __ATOMIC_ACQUIRE) > u.sqmask)
+    {
+	__atomic_store_n(u.sqtail, u.sqlocal, __ATOMIC_RELEASE);
+	if (enter(u.tosubmit, 0, 0, NULL, 0) < 0)
+	    perror("io_uring_enter");
+	u.tosubmit = 0;
+    }
+    sqe = &u.sqes[u.sqlocal & u.sqmask];
+    u.sqarray[u.sqlocal & u.sqmask] = u.sqlocal & u.sqmask;
+    u.sqlocal++;
+    u.tosubmit++;
+    memset(sqe, 0, sizeof(*sqe));
+    return sqe;
+}
+
+// This function submits everything queued and waits until something completes or timeout ms pass
+// It copies at most max completions to c and returns how many, 0 on timeout or signal, -1 on error
+int uring_wait(struct ucomp *c, int max, int timeout)
+{
+    struct io_uring_getevents_arg arg;
+    struct __kernel_timespec ts;
+    unsigned int head, tail, flags = IORING_ENTER_GETEVENTS;
+    int n = 0;
+    __atomic_store_n(u.sqtail, u.sqlocal, __ATOMIC_RELEASE);
+    head = *u.cqhead;
+    tail = __atomic_load_n(u.cqtail, __ATOMIC_ACQUIRE);
+    memset(&arg, 0, sizeof(arg));
+    if (timeout >= 0)
+    {
+	ts.tv_sec = timeout / 1000;
+	ts.tv_nsec = (timeout % 1000) * 1000000L;
+	arg.ts = (uint64_t)(uintptr_t)&ts;
+    }
+    arg.sigmask_sz = _NSIG / 8;
+    // Only block if nothing has completed yet
+    if (enter(u.tosubmit, head == tail ? 1 : 0, flags | IORING_ENTER_EXT_ARG, &arg, sizeof(arg)) < 0 &&
+	errno != ETIME && errno != EINTR && errno != EBUSY)
+    {
+	perror("io_uring_enter");
+	return -1;
+    }
+    u.tosubmit = 0;
+    tail = __atomic_load_n(u.cqtail, __ATOMIC_ACQUIRE);
+    while (head != tail && n < max)
+    {
+	struct io_uring_cqe *cqe = &u.cqes[head & u.cqmask];
+	c[n].data = cqe->user_data;
+	c[n].res = cqe->res;
+	c[n].flags = cqe->flags;
+	n++;
+	head++;
+    }
+    __atomic_store_n(u.cqhead, head, __ATOMIC_RELEASE);
+    return n;
+}
+
+// This function queues a multishot accept on the listening socket fd
+// Every new connection completes with its descriptor (non-blocking)
+void uring_accept(int fd, uint64_t data)
+{
+    struct io_uring_sqe *sqe = getsqe();
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = fd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+    sqe->user_data = data;
+}
+
+// This function queues a multishot poll for fd becoming readable
+void uring_poll(int fd, uint64_t data)
+{
+    struct io_uring_sqe *sqe = getsqe();
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->poll32_events = POLLIN;
+    sqe->len = IORING_POLL_ADD_MULTI;
+    sqe->user_data = data;
+}
+
+// This function queues a multishot receive on fd
+// Each piece of input completes with its length and the provided buffer it is in,
+// 0 at end of file
+void uring_recv(int fd, uint64_t data)
+{
+    struct io_uring_sqe *sqe = getsqe();
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = fd;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = BGID;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->user_data = data;
+}
+
+// This function queues a send of all len bytes of buf on fd (buf must stay put until it completes)
+// With link set, the next send queued starts only after this one has sent everything,
+// and is cancelled if this one fails or comes up short
+void uring_send(int fd, const void *buf, size_t len, int link, uint64_t data)
+{
+    struct io_uring_sqe *sqe = getsqe();
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(uintptr_t)buf;
+    sqe->len = len;
+    // MSG_MORE holds back a linked send's last partial packet until the next one, as one
+    // writev() would; otherwise Nagle waits for the peer's (delayed) ACK between them
+    sqe->msg_flags = MSG_WAITALL | MSG_NOSIGNAL | (link ? MSG_MORE : 0);
+    sqe->flags = link ? IOSQE_IO_LINK : 0;
+    sqe->user_data = data;
+}
+
+// This function cancels every operation queued on fd
+// A send cancelled part way completes with the bytes it did send
+void uring_cancel(int fd)
+{
+    struct io_uring_sqe *sqe = getsqe();
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = fd;
+    sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+    sqe->flags = IOSQE_CQE_SKIP_SUCCESS; // only a failure completes, with data 0
+    sqe->user_data = 0;
+}
+
+// This function returns 1 if c's operation is still armed (multishot)
+int uring_more(const struct ucomp *c)
+{
+    return (c->flags & IORING_CQE_F_MORE) != 0;
+}
+
+// This function returns the provided buffer a receive completed into, or NULL
+char *uring_buf(const struct ucomp *c)
+{
+    if (!(c->flags & IORING_CQE_F_BUFFER))
+	return NULL;
+    return u.bufs + (size_t)(c->flags >> IORING_CQE_BUFFER_SHIFT) * BUFSIZE;
+}
+
+// This function hands the buffer c completed into back to the kernel
+void uring_putbuf(const struct ucomp *c)
+{
+    unsigned short tail = u.br->tail;
+    struct io_uring_buf *b;
+    int bid;
+    if (!(c->flags & IORING_CQE_F_BUFFER))
+	return;
+    bid = c->flags >> IORING_CQE_BUFFER_SHIFT;
+    b = &u.br->bufs[tail & (NBUFS - 1)];
+    b->addr = (uint64_t)(uintptr_t)(u.bufs + (size_t)bid * BUFSIZE);
+    b->len = BUFSIZE;
+    b->bid = bid;
+    __atomic_store_n(&u.br->tail, (unsigned short)(tail + 1), __ATOMIC_RELEASE);
+}
+
+#else
+//============================================
+// No io_uring (not Linux, or built with -DNO_URING)
+//============================================
+int uring_init(void) { errno = ENOSYS; return -1; }
+int uring_wait(struct ucomp *c, int max, int timeout) { errno = ENOSYS; return -1; }
+void uring_accept(int fd, uint64_t data) {}
+void uring_poll(int fd, uint64_t data) {}
+void uring_recv(int fd, uint64_t data) {}
+void uring_send(int fd, const void *buf, size_t len, int link, uint64_t data) {}
+void uring_cancel(int fd) {}
+int uring_more(const struct ucomp *c) { return 0; }
+char *uring_buf(const struct ucomp *c) { return NULL; }
+void uring_putbuf(const struct ucomp *c) {}
+#endif
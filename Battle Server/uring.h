@@ -0,0 +1,35 @@
+// uring - io_uring backend for the battleserver (Linux 6.0 and later)
+// Instead of waiting for readiness and then calling read()/write(), the server queues
+// the operations themselves and collects their completions, many per io_uring_enter():
+// multishot accept, multishot receive into provided buffers, and chains of linked sends.
+// Each thread that calls uring_init() gets its own ring, like the reactor.
+// Build with -DNO_URING to leave it out; uring_init() then always fails.
+#ifndef URING_H
+#define URING_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// One completion returned by uring_wait()
+struct ucomp
+{
+    uint64_t data; // the data the operation was queued with
+    int res; // what the system call would have returned, -errno on error
+    unsigned int flags; // see uring_more() and uring_buf()
+};
+
+//============================================
+// Function Prototypes
+//============================================
+int uring_init(void); // create the ring and its receive buffers, returns -1 if the kernel can't
+int uring_wait(struct ucomp *c, int max, int timeout); // submit what is queued, then wait (timeout in ms, -1 forever)
+void uring_accept(int fd, uint64_t data); // accept every connection on fd until it fails
+void uring_poll(int fd, uint64_t data); // report every time fd becomes readable
+void uring_recv(int fd, uint64_t data); // receive everything sent to fd, each piece in a provided buffer
+void uring_send(int fd, const void *buf, size_t len, int link, uint64_t data); // send all of buf, link: the next send waits for it
+void uring_cancel(int fd); // cancel every operation on fd (each completes with -ECANCELED or what it did so far)
+int uring_more(const struct ucomp *c); // 1 if the operation is still armed and will complete again
+char *uring_buf(const struct ucomp *c); // the provided buffer a receive filled, NULL if none
+void uring_putbuf(const struct ucomp *c); // give that buffer back to the kernel
+
+#endif
@@ -1,6 +1,7 @@
 #include <stdio.h>
 #include <unistd.h>
 #include <sys/types.h>
+#include <sys/uio.h> // writev()
 #include <errno.h>
 
 // Helper Function
@@ -35,3 +36,32 @@ int Writen(int fd, void *ptr, size_t nbytes)
     }
     return (n);
 }
+
+// Helper Function
+// Write the iovcnt buffers in iov to a descriptor with one system call
+// Returns the number of bytes written, which may be less than the total
+ssize_t writevn(int fd, const struct iovec *iov, int iovcnt)
+{
+    ssize_t nwritten; // number of bytes written
+        if ( (nwritten = writev(fd, iov, iovcnt)) < 0)
+	{
+            if (errno == EINTR) // if disturbed by signal
+                nwritten = 0;        // caller will call writev() again
+            else
+                return(-1);
+        }
+    return(nwritten);
+}
+
+// This function writes iovcnt buffers to fd from iov
+ssize_t Writev(int fd, const struct iovec *iov, int iovcnt)
+{
+    ssize_t n;
+    if ((n = writevn(fd, iov, iovcnt)) < 0)
+    {
+        if (errno != EAGAIN && errno != EWOULDBLOCK) // socket buffer full on a non-blocking fd
+            perror("writev error");
+        return (-1);
+    }
+    return (n);
+}